@@ -0,0 +1,245 @@
+#include "ApngEncoder.h"
+#include "util.h"
+#include "lodepng.h"
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+ApngEncoder::ApngEncoder(int width, int height, float fps, int numThreads) {
+	this->width = width;
+	this->height = height;
+	this->fps = fps;
+
+	if (numThreads <= 0) {
+		numThreads = max(1, (int)std::thread::hardware_concurrency());
+	}
+	for (int i = 0; i < numThreads; i++) {
+		workers.push_back(std::thread(&ApngEncoder::workerLoop, this));
+	}
+}
+
+ApngEncoder::~ApngEncoder() {
+	stopWorkers();
+
+	for (int i = 0; i < frames.size(); i++) {
+		free(frames[i]->png);
+		delete frames[i];
+	}
+}
+
+void ApngEncoder::stopWorkers() {
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		stopping = true;
+	}
+	queueSignal.notify_all();
+
+	for (int i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+	workers.clear();
+}
+
+void ApngEncoder::workerLoop() {
+	while (true) {
+		Frame* frame;
+		{
+			std::unique_lock<std::mutex> guard(queueLock);
+			queueSignal.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) {
+				return; // stopping and nothing left to do
+			}
+			frame = queue.front();
+			queue.pop_front();
+		}
+
+		compress(frame);
+	}
+}
+
+void ApngEncoder::compress(Frame* frame) {
+	LodePNGState state;
+	lodepng_state_init(&state);
+
+	// every frame must use the color type in the IHDR chunk
+	state.encoder.auto_convert = 0;
+	state.info_png.color.colortype = LCT_RGBA;
+	state.info_png.color.bitdepth = 8;
+
+	frame->error = lodepng_encode(&frame->png, &frame->pngSize, &frame->pixels[0], frame->width, frame->height, &state);
+	lodepng_state_cleanup(&state);
+
+	std::vector<uint8_t>().swap(frame->pixels);
+}
+
+void ApngEncoder::getChangedRegion(const uint8_t* rgba, int& x, int& y, int& w, int& h) {
+	const uint32_t* cur = (const uint32_t*)rgba;
+	const uint32_t* last = (const uint32_t*)&lastFrame[0];
+
+	int minX = width, minY = height, maxX = -1, maxY = -1;
+
+	for (int py = 0; py < height; py++) {
+		const uint32_t* curRow = cur + py * width;
+		const uint32_t* lastRow = last + py * width;
+
+		if (!memcmp(curRow, lastRow, width * 4)) {
+			continue;
+		}
+
+		int left = 0;
+		while (curRow[left] == lastRow[left]) {
+			left++;
+		}
+		int right = width - 1;
+		while (curRow[right] == lastRow[right]) {
+			right--;
+		}
+
+		minX = min(minX, left);
+		maxX = max(maxX, right);
+		minY = min(minY, py);
+		maxY = py;
+	}
+
+	if (maxY < 0) {
+		// nothing changed. Frames can't be empty, so replace a single pixel with itself.
+		x = y = 0;
+		w = h = 1;
+		return;
+	}
+
+	x = minX;
+	y = minY;
+	w = maxX - minX + 1;
+	h = maxY - minY + 1;
+}
+
+void ApngEncoder::addFrame(const uint8_t* rgba) {
+	Frame* frame = new Frame();
+
+	if (frames.empty()) {
+		// the first frame is also the default image, so it must cover everything
+		frame->x = frame->y = 0;
+		frame->width = width;
+		frame->height = height;
+		lastFrame.resize(width * height * 4);
+	}
+	else {
+		getChangedRegion(rgba, frame->x, frame->y, frame->width, frame->height);
+	}
+
+	frame->pixels.resize(frame->width * frame->height * 4);
+	for (int row = 0; row < frame->height; row++) {
+		const uint8_t* src = rgba + ((frame->y + row) * width + frame->x) * 4;
+		memcpy(&frame->pixels[row * frame->width * 4], src, frame->width * 4);
+	}
+	memcpy(&lastFrame[0], rgba, width * height * 4);
+
+	frames.push_back(frame);
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		queue.push_back(frame);
+	}
+	queueSignal.notify_one();
+}
+
+static void writeUint32(std::vector<uint8_t>& out, uint32_t val) {
+	out.push_back(val >> 24);
+	out.push_back(val >> 16);
+	out.push_back(val >> 8);
+	out.push_back(val);
+}
+
+static void writeUint16(std::vector<uint8_t>& out, uint16_t val) {
+	out.push_back(val >> 8);
+	out.push_back(val);
+}
+
+static void writeChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t len) {
+	writeUint32(out, len);
+	size_t crcStart = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + len);
+	writeUint32(out, lodepng_crc32(&out[crcStart], len + 4));
+}
+
+bool ApngEncoder::save(std::string path) {
+	stopWorkers();
+
+	if (frames.empty()) {
+		printf("No frames to save in %s\n", path.c_str());
+		return false;
+	}
+
+	for (int i = 0; i < frames.size(); i++) {
+		if (frames[i]->error) {
+			printf("Failed to encode frame %d: %s\n", i, lodepng_error_text(frames[i]->error));
+			return false;
+		}
+	}
+
+	const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	std::vector<uint8_t> out(signature, signature + 8);
+	std::vector<uint8_t> chunk;
+	uint32_t sequence = 0; // shared by fcTL and fdAT chunks
+
+	// delay fraction is stored as 16-bit values
+	uint16_t delayNum = 100;
+	uint16_t delayDen = (uint16_t)clamp(roundf(fps * 100), 1, 65535);
+
+	for (int i = 0; i < frames.size(); i++) {
+		Frame* frame = frames[i];
+		uint8_t* end = frame->png + frame->pngSize;
+
+		chunk.clear();
+		writeUint32(chunk, sequence++);
+		writeUint32(chunk, frame->width);
+		writeUint32(chunk, frame->height);
+		writeUint32(chunk, frame->x);
+		writeUint32(chunk, frame->y);
+		writeUint16(chunk, delayNum);
+		writeUint16(chunk, delayDen);
+		chunk.push_back(0); // dispose: keep the frame for the next one to draw over
+		chunk.push_back(0); // blend: replace the region instead of alpha blending
+		std::vector<uint8_t> fctl = chunk;
+
+		for (uint8_t* c = frame->png + 8; c + 12 <= end; c += lodepng_chunk_length(c) + 12) {
+			const uint8_t* data = lodepng_chunk_data_const(c);
+			unsigned len = lodepng_chunk_length(c);
+
+			if (i == 0 && lodepng_chunk_type_equals(c, "IHDR")) {
+				writeChunk(out, "IHDR", data, len);
+
+				chunk.clear();
+				writeUint32(chunk, frames.size());
+				writeUint32(chunk, 0); // loop forever
+				writeChunk(out, "acTL", &chunk[0], chunk.size());
+				writeChunk(out, "fcTL", &fctl[0], fctl.size());
+			}
+			else if (lodepng_chunk_type_equals(c, "IDAT")) {
+				if (i == 0) {
+					writeChunk(out, "IDAT", data, len);
+				}
+				else {
+					if (!fctl.empty()) {
+						writeChunk(out, "fcTL", &fctl[0], fctl.size());
+						fctl.clear();
+					}
+					chunk.clear();
+					writeUint32(chunk, sequence++);
+					chunk.insert(chunk.end(), data, data + len);
+					writeChunk(out, "fdAT", &chunk[0], chunk.size());
+				}
+			}
+		}
+	}
+
+	writeChunk(out, "IEND", NULL, 0);
+
+	if (!writeFile(path, (const char*)&out[0], out.size())) {
+		printf("Failed to write %s\n", path.c_str());
+		return false;
+	}
+
+	return true;
+}
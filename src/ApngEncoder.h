@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+// Builds an animated PNG from RGBA frames (top row first). Each frame is cropped to the region
+// that changed since the previous frame, then filtered and compressed by lodepng on worker
+// threads while the caller renders the next frame. The IDAT chunks of the compressed frames
+// are rewritten as APNG frame chunks when the file is saved.
+class ApngEncoder
+{
+public:
+	ApngEncoder(int width, int height, float fps, int numThreads = 0); // 0 = one thread per CPU core
+	~ApngEncoder();
+
+	// queue a full-size frame for compression. The pixels are copied.
+	void addFrame(const uint8_t* rgba);
+
+	// wait for every frame to be compressed, then write the file. Returns false on failure.
+	bool save(std::string path);
+
+private:
+	struct Frame {
+		int x, y, width, height; // area of the image that this frame replaces
+		std::vector<uint8_t> pixels; // cropped RGBA, freed after compression
+		unsigned char* png = NULL; // compressed frame as a complete PNG file
+		size_t pngSize = 0;
+		unsigned error = 0;
+	};
+
+	int width;
+	int height;
+	float fps;
+
+	std::vector<uint8_t> lastFrame; // for finding the changed region of the next frame
+	std::vector<Frame*> frames;
+	std::deque<Frame*> queue; // frames waiting for a worker
+	std::vector<std::thread> workers;
+	std::mutex queueLock;
+	std::condition_variable queueSignal;
+	bool stopping = false;
+
+	void workerLoop();
+	void compress(Frame* frame);
+	void stopWorkers();
+	void getChangedRegion(const uint8_t* rgba, int& x, int& y, int& w, int& h);
+};
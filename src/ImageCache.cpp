@@ -0,0 +1,118 @@
+#include "ImageCache.h"
+#include "util.h"
+#include "md5.h"
+#include <thread>
+#include <functional>
+#include <cstring>
+
+#if defined(WIN32) || defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+ImageCache::ImageCache(string dir) : hits(0), misses(0) {
+	if (dir.size() && dir[dir.size() - 1] != '/' && dir[dir.size() - 1] != '\\') {
+		dir += "/";
+	}
+	this->dir = dir;
+
+	valid = createDir(dir);
+	if (!valid) {
+		printf("Failed to create image cache directory: %s\n", dir.c_str());
+	}
+}
+
+bool ImageCache::addFileHash(MD5& md5, string path) {
+	int len;
+	char* buffer = loadFile(path, len);
+	if (!buffer) {
+		return false;
+	}
+
+	md5.add(buffer, len);
+	delete[] buffer;
+	return true;
+}
+
+string ImageCache::getKey(string modelPath, int width, int height, bool software, const ImageParams& params) {
+	MD5 md5 = MD5();
+
+	if (!addFileHash(md5, modelPath)) {
+		return "";
+	}
+
+	// external models are hashed whether or not the model uses them. An unused file
+	// only costs a cache miss, while parsing the header here would cost a model load.
+	// Paths must match the ones MdlRenderer loads.
+	addFileHash(md5, getExternalModelPath(modelPath, "t"));
+	for (int i = 1; i < MAXSTUDIOSEQUENCES; i++) {
+		string suffix = i < 10 ? "0" + to_string(i) : to_string(i);
+		if (!addFileHash(md5, getExternalModelPath(modelPath, suffix))) {
+			break;
+		}
+	}
+
+	// floats are written with enough digits to tell every value apart
+	char opts[256];
+	snprintf(opts, 256, "v%d %dx%d %d seq=%d frame=%.9g yaw=%.9g pitch=%.9g body=%d skin=%d colors=%d,%d grid=%dx%d",
+		IMAGE_RENDER_VERSION, width, height, (int)software, params.sequence, params.frame,
+		params.yaw, params.pitch, params.body, params.skin, params.topcolor, params.bottomcolor,
+		params.gridAngles, params.gridFrames);
+	md5.add(opts, strlen(opts));
+
+	return md5.getHash();
+}
+
+string ImageCache::getPath(string key) {
+	return dir + key + ".png";
+}
+
+bool ImageCache::load(string key, string outPath) {
+	int len;
+	char* buffer = valid && key.size() ? loadFile(getPath(key), len) : NULL;
+	if (!buffer) {
+		misses++;
+		return false;
+	}
+
+	bool ok = writeFile(outPath, buffer, len);
+	delete[] buffer;
+
+	if (!ok) {
+		printf("Failed to write %s\n", outPath.c_str());
+		misses++;
+		return false;
+	}
+
+	hits++;
+	return true;
+}
+
+void ImageCache::store(string key, string imagePath) {
+	int len;
+	char* buffer = valid && key.size() ? loadFile(imagePath, len) : NULL;
+	if (!buffer) {
+		return;
+	}
+
+	// unique per process and thread, in case other jobs or runs are storing the same image
+	size_t threadId = std::hash<std::thread::id>()(std::this_thread::get_id());
+	string path = getPath(key);
+	string tempPath = path + "." + to_string(getpid()) + "_" + to_string(threadId) + ".tmp";
+
+	bool ok = writeFile(tempPath, buffer, len);
+	delete[] buffer;
+
+	// rename fails on Windows if the file exists, which means the same image was already stored
+	if (!ok || rename(tempPath.c_str(), path.c_str()) != 0) {
+		remove(tempPath.c_str());
+	}
+}
+
+void ImageCache::printStats() {
+	int total = hits + misses;
+	printf("Image cache: %d hits, %d misses (%.1f%% hit rate)\n", (int)hits, (int)misses,
+		total ? (hits * 100.0f) / total : 0.0f);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "Renderer.h"
+#include "md5.h"
+#include <atomic>
+
+// Rendered images stored by a hash of the model content and every option that affects the
+// pixels, so that models which haven't changed since the last run aren't rendered again.
+// Images are written to a temp file and renamed into place, so an interrupted run or another
+// process using the same directory never sees a partial image. Safe to use from multiple threads.
+class ImageCache
+{
+public:
+	ImageCache(string dir);
+
+	// false if the cache directory couldn't be created
+	bool isValid() { return valid; }
+
+	// key for an image of the model, or an empty string if the model can't be read.
+	// Includes external texture and sequence models, since they're merged when rendering.
+	string getKey(string modelPath, int width, int height, bool software, const ImageParams& params);
+
+	// copy the cached image to outPath. Returns false if it isn't cached.
+	bool load(string key, string outPath);
+
+	// copy a rendered image into the cache
+	void store(string key, string imagePath);
+
+	void printStats();
+
+private:
+	string dir;
+	bool valid;
+	std::atomic<int> hits;
+	std::atomic<int> misses;
+
+	string getPath(string key);
+	bool addFileHash(MD5& md5, string path);
+};
@@ -11,55 +11,75 @@
 #include <float.h>
 #include "Renderer.h"
 #include <cstring>
+#include <unordered_set>
+#include <algorithm>
+#include "lib/md5.h"
+#include "SoftRasterizer.h"
 
 void glCheckError(const char* checkMessage);
 
-MdlRenderer::MdlRenderer(ShaderProgram* shader, ShaderProgram* wireShader, bool legacy_mode, string modelPath) {
+MdlRenderer::MdlRenderer(ShaderVariants* shaders, ShaderProgram* wireShader, bool legacy_mode, bool paletted, string modelPath) {
 	this->fpath = modelPath;
 	this->legacy_mode = legacy_mode;
-	this->shader = shader;
+	this->paletted = paletted;
+	this->shaders = shaders;
+	this->shader = shaders ? shaders->get(0) : NULL;
 	this->wireShader = wireShader;
 	valid = false;
 	needTransform = true;
 	u_boneTexture = -1;
 	oldLegacyMode = false;
 
-	loadData();
-	upload();
+	if (!shaders) {
+		return; // software rendering
+	}
+
+	u.sTex = shader->getUniformHandle("sTex");
+	u.sPalette = shader->getUniformHandle("sPalette");
+	u.texSize = shader->getUniformHandle("texSize");
+	u.uvScale = shader->getUniformHandle("uvScale");
+	u.elights = shader->getUniformHandle("elights");
+	u.ambient = shader->getUniformHandle("ambient");
+	u.lights = shader->getUniformHandle("lights");
+	u.colorMult = shader->getUniformHandle("colorMult");
+	u.remapRanges = shader->getUniformHandle("remapRanges");
+	u.remapHues = shader->getUniformHandle("remapHues");
+	u.wireColor = wireShader->getUniformHandle("wireColor");
+
+	if (!legacy_mode) {
+		u.viewerOrigin = shader->getUniformHandle("viewerOrigin");
+		u.viewerRight = shader->getUniformHandle("viewerRight");
+		u.boneMatrixTexture = shader->getUniformHandle("boneMatrixTexture");
+		u.wireBoneMatrixTexture = wireShader->getUniformHandle("boneMatrixTexture");
+	}
+
 }
 
 MdlRenderer::~MdlRenderer() {
+	for (auto& file : fileBuffers) {
+		delete[] file.second.data;
+	}
+
 	if (valid) {
 		for (int i = 0; i < numTextures; i++) {
 			delete glTextures[i];
 		}
 		delete[] glTextures;
 
-		for (int b = 0; b < header->numbodyparts; b++) {
-			data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
-			mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
-
-			for (int m = 0; m < bod->nummodels; m++) {
-				data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
-				mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
-
-				for (int k = 0; k < mod->nummesh; k++) {
-					MdlMeshRender& render = meshBuffers[b][m][k];
-
-					delete[] render.origVerts;
-					delete[] render.origNorms;
-					delete[] render.transformVerts;
-					delete[] render.verts;
-					delete[] render.wireVerts;
-					delete render.buffer;
-					delete render.wireBuffer;
-				}
-
-				delete[] meshBuffers[b][m];
+		if (glPalettes) {
+			for (int i = 0; i < numTextures; i++) {
+				delete glPalettes[i];
 			}
-
-			delete[] meshBuffers[b];
+			delete[] glPalettes;
 		}
+
+		// mesh info is freed with the arena
+		delete wireBuffer;
+		delete[] wireIndexes;
+		delete meshBuffer;
+		delete[] meshVerts;
+		delete[] meshIndexes;
+
 		for (int i = 0; i < MAXSTUDIOSEQUENCES && i < seqheaders.size(); i++) {
 			if (seqheaders[i].getBuffer())
 				seqheaders[i].freeBuf();
@@ -98,6 +118,11 @@ bool MdlRenderer::validate() {
 		return false;
 	}
 
+	if (header->numbones > MAXSTUDIOBONES) {
+		printf("ERROR: Too many bones (%d) in model\n", header->numbones);
+		return false;
+	}
+
 	if (data.eom())
 		return false;
 
@@ -115,6 +140,14 @@ bool MdlRenderer::validate() {
 				return false;
 			}
 
+			if (!validateBoneRefs(mod->vertinfoindex, mod->numverts, "Vertex") ||
+				!validateBoneRefs(mod->norminfoindex, mod->numnorms, "Normal")) {
+				return false;
+			}
+
+			maxModelVerts = max(maxModelVerts, mod->numverts);
+			maxModelNorms = max(maxModelNorms, mod->numnorms);
+
 			for (int k = 0; k < mod->nummesh; k++) {
 				data.seek(mod->meshindex + k * sizeof(mstudiomesh_t));
 
@@ -173,6 +206,9 @@ bool MdlRenderer::validate() {
 					printf("ERROR: Bad tri vert idx in mesh %d in model %d\n", k, i);
 					return false;
 				}
+
+				maxModelVerts = max(maxModelVerts, maxVertIdx + 1);
+				maxModelNorms = max(maxModelNorms, maxNormIdx + 1);
 			}
 		}
 	}
@@ -329,9 +365,83 @@ bool MdlRenderer::hasExternalSequences() {
 	return header->numseqgroups > 1;
 }
 
+bool MdlRenderer::validateBoneRefs(int offset, int count, const char* desc) {
+	if (count <= 0) {
+		return true;
+	}
+
+	data.seek(offset + count - 1);
+	if (data.eom()) {
+		printf("ERROR: Failed to load %s bone info\n", desc);
+		return false;
+	}
+
+	data.seek(offset);
+	uint8_t* bones = (uint8_t*)data.get();
+
+	for (int i = 0; i < count; i++) {
+		if (bones[i] >= header->numbones) {
+			printf("ERROR: %s %d references invalid bone %d\n", desc, i, bones[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void MdlRenderer::allocWorkingMemory() {
+	numBones = max(header->numbones, 1);
+	int numSeq = max(header->numseq, 1);
+	int numVerts = max(maxModelVerts, 1);
+	int numNorms = max(maxModelNorms, 1);
+
+	// keep the per-frame data together
+	arena.reserve(numBones * (sizeof(vec3) * 4 + sizeof(vec4) * 4 + sizeof(float) * 4 * 4)
+		+ (numVerts + numNorms) * sizeof(vec3) + numSeq * sizeof(AABB) + 16 * alignof(max_align_t));
+
+	m_bonetransform = (float(*)[4][4])arena.alloc<float>(numBones * 4 * 4);
+	pos = arena.alloc<vec3>(numBones);
+	q = arena.alloc<vec4>(numBones);
+	pos2 = arena.alloc<vec3>(numBones);
+	q2 = arena.alloc<vec4>(numBones);
+	pos3 = arena.alloc<vec3>(numBones);
+	q3 = arena.alloc<vec4>(numBones);
+	pos4 = arena.alloc<vec3>(numBones);
+	q4 = arena.alloc<vec4>(numBones);
+	transformedVerts = arena.alloc<vec3>(numVerts);
+	transformedNormals = arena.alloc<vec3>(numNorms);
+	cachedBounds = arena.alloc<AABB>(numSeq);
+}
+
+void MdlRenderer::addFileBuffer(MdlFileBuffer file) {
+	auto existing = fileBuffers.find(file.path);
+	if (existing != fileBuffers.end()) {
+		delete[] existing->second.data;
+	}
+
+	fileBuffers[file.path] = file;
+}
+
+char* MdlRenderer::loadModelFile(const string& path, int& len) {
+	auto file = fileBuffers.find(path);
+	if (file == fileBuffers.end()) {
+		return loadFile(path, len);
+	}
+
+	// parse in place instead of copying
+	char* data = file->second.data;
+	len = file->second.len;
+	fileBuffers.erase(file);
+	return data;
+}
+
+bool MdlRenderer::modelFileExists(const string& path) {
+	return fileBuffers.count(path) || fileExists(path);
+}
+
 void MdlRenderer::loadData() {
 	int len;
-	char* buffer = loadFile(fpath, len);
+	char* buffer = loadModelFile(fpath, len);
 	if (!buffer) {
 		return;
 	}
@@ -339,15 +449,20 @@ void MdlRenderer::loadData() {
 	data = mstream(buffer, len);
 	texheader = header = (studiohdr_t*)buffer;
 	texdata = mstream(buffer, len);
+
+	MD5 md5 = MD5();
+	md5.add(buffer, len);
+	hash = md5.getHash();
 	if (!validate() || isEmpty()) {
 		return;
 	}
 
 	memset(iController, 127, 4);
 	memset(iBlender, 127, 2);
-	memset(cachedBounds, 0, sizeof(cachedBounds));
 	iMouth = 0;
 
+	allocWorkingMemory();
+
 	if (!loadTextureData() || !loadSequenceData()) {
 		return;
 	}
@@ -358,33 +473,32 @@ void MdlRenderer::loadData() {
 	//transformVerts();
 
 	valid = true;
+
+	// bounds for the first sequence are needed to fit the model to the view. Calculating
+	// them here keeps that work on the loading thread.
+	vec3 mins, maxs;
+	getModelBoundingBox(angles, 0, mins, maxs);
+	SetUpBones(angles, 0, 0);
 }
 
 void MdlRenderer::upload() {
+	if (!valid || !shaders) {
+		return; // nothing was loaded, or the model is rendered in software
+	}
+
 	for (int i = 0; i < numTextures; i++) {
-		if (!glTextures[i]->uploaded) {
+		if (glTextures[i] && !glTextures[i]->uploaded) {
 			glTextures[i]->upload(glTextures[i]->format);
 		}
+		if (glPalettes && glPalettes[i] && !glPalettes[i]->uploaded) {
+			glPalettes[i]->upload(glPalettes[i]->format);
+		}
 	}
 
 	glCheckError("MDL texture uploads");
 
-	for (int b = 0; b < header->numbodyparts; b++) {
-		// Try loading required model info
-		data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
-		mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
-
-		for (int m = 0; m < bod->nummodels; m++) {
-			data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
-			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
-
-			for (int k = 0; k < mod->nummesh; k++) {
-				if (!meshBuffers[b][m][k].buffer->isUploaded()) {
-					meshBuffers[b][m][k].buffer->upload();
-					meshBuffers[b][m][k].wireBuffer->upload();
-				}
-			}
-		}
+	if (!meshBuffer->isUploaded()) {
+		meshBuffer->upload();
 	}
 
 	glCheckError("MDL body mesh uploads");
@@ -401,11 +515,145 @@ void MdlRenderer::upload() {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 
-		// allocate data so subImage can be used for faster updates
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 4, MAXSTUDIOBONES, 0, GL_RGBA, GL_FLOAT, m_bonetransform);
+		// allocate data so subImage can be used for faster updates. Only the model's bones are updated.
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 4, MAXSTUDIOBONES, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, numBones, GL_RGBA, GL_FLOAT, m_bonetransform);
 		
 		glCheckError("MDL bone texture creation");
 	}
+
+	freeUploadedData();
+}
+
+void MdlRenderer::freeUploadedData() {
+	for (int i = 0; i < numTextures; i++) {
+		if (glTextures[i] && glTextures[i]->uploaded)
+			glTextures[i]->freeData();
+		if (glPalettes && glPalettes[i] && glPalettes[i]->uploaded)
+			glPalettes[i]->freeData();
+	}
+
+	if (header != texheader) {
+		// everything needed from the external texture model has been loaded
+		delete[] texdata.getBuffer();
+		texdata = data;
+		texheader = header;
+	}
+	else {
+		trimTextureData();
+	}
+
+	if (!legacy_mode) {
+		// vertices are transformed on the GPU, so the vertex data is never uploaded again
+		// (bounding boxes are calculated with MdlMeshRender::transformVerts instead)
+		for (int b = 0; b < header->numbodyparts; b++) {
+			data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
+			mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
+
+			for (int m = 0; m < bod->nummodels; m++) {
+				data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
+				mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
+
+				for (int k = 0; k < mod->nummesh; k++) {
+					meshBuffers[b][m][k].verts = NULL;
+				}
+			}
+		}
+
+		meshBuffer->setData(NULL, meshBuffer->numVerts);
+		delete[] meshVerts;
+		meshVerts = NULL;
+	}
+}
+
+void MdlRenderer::trimTextureData() {
+	if (header->numtextures <= 0) {
+		return;
+	}
+
+	// Texture pixels and palettes are usually the last thing in the file. Only trim them
+	// if they fill the end of the file with nothing else mixed in.
+	size_t texStart = data.size();
+	size_t texEnd = 0;
+	size_t texBytes = 0;
+
+	for (int i = 0; i < header->numtextures; i++) {
+		data.seek(header->textureindex + i * sizeof(mstudiotexture_t));
+		mstudiotexture_t* tex = (mstudiotexture_t*)data.get();
+		size_t sz = (size_t)tex->width * tex->height + 256 * 3;
+
+		if (data.eom() || tex->index < 0 || tex->index + sz > data.size()) {
+			return;
+		}
+
+		texStart = min(texStart, (size_t)tex->index);
+		texEnd = max(texEnd, tex->index + sz);
+		texBytes += sz;
+	}
+
+	if (texEnd != data.size() || texEnd - texStart != texBytes || texStart < sizeof(studiohdr_t)) {
+		return;
+	}
+
+	char* trimmed = new char[texStart];
+	memcpy(trimmed, data.getBuffer(), texStart);
+	delete[] data.getBuffer();
+
+	data = mstream(trimmed, texStart);
+	texdata = data;
+	header = texheader = (studiohdr_t*)trimmed;
+}
+
+size_t MdlRenderer::getResidentBytes() {
+	size_t total = sizeof(MdlRenderer) + arena.size();
+
+	total += data.size();
+	if (header != texheader)
+		total += texdata.size();
+	for (int i = 0; i < seqheaders.size(); i++)
+		total += seqheaders[i].size();
+
+	for (int i = 0; i < numTextures; i++) {
+		if (glTextures[i] && glTextures[i]->data)
+			total += glTextures[i]->width * glTextures[i]->height * 4;
+		if (glPalettes && glPalettes[i] && glPalettes[i]->data)
+			total += 256 * sizeof(COLOR4);
+	}
+
+	int numMeshVerts = meshBuffer ? meshBuffer->numVerts : 0;
+	int numMeshIndexes = meshBuffer ? meshBuffer->numIndexes : 0;
+	if (meshVerts)
+		total += numMeshVerts * sizeof(boneVert);
+	if (meshIndexes)
+		total += numMeshIndexes * sizeof(uint32_t);
+	if (wireIndexes)
+		total += wireBuffer->numIndexes * sizeof(uint32_t);
+
+	total += drawList.capacity() * sizeof(MdlDrawItem);
+
+	return total;
+}
+
+size_t MdlRenderer::getGpuBytes() {
+	size_t total = 0;
+
+	for (int i = 0; i < numTextures; i++) {
+		if (glTextures[i])
+			total += glTextures[i]->getGpuBytes();
+		if (glPalettes && glPalettes[i])
+			total += glPalettes[i]->getGpuBytes();
+	}
+
+	if (meshBuffer) {
+		total += meshBuffer->numVerts * sizeof(boneVert);
+		total += meshBuffer->numIndexes * sizeof(uint32_t);
+	}
+	if (wireBuffer)
+		total += wireBuffer->numIndexes * sizeof(uint32_t);
+	if (!legacy_mode)
+		total += MAXSTUDIOBONES * 4 * 4 * sizeof(float); // bone texture
+
+	return total;
 }
 
 #include <lodepng.h>
@@ -414,18 +662,10 @@ bool MdlRenderer::loadTextureData() {
 	bool externalTextures = hasExternalTextures();
 
 	if (externalTextures) {
-		int lastDot = fpath.find_last_of(".");
-		if (lastDot == -1) {
-			printf("Failed to load external texture model for: %s\n", fpath.c_str());
-			return false;
-		}
-
-		string ext = fpath.substr(lastDot);
-		string basepath = fpath.substr(0, lastDot);
-		string tpath = basepath + "t" + ext;
+		string tpath = getExternalModelPath(fpath, "t");
 
 		int len;
-		char* buffer = loadFile(tpath, len);
+		char* buffer = loadModelFile(tpath, len);
 		if (!buffer) {
 			printf("Failed to load external texture model: %s\n", tpath.c_str());
 			return false;
@@ -440,6 +680,14 @@ bool MdlRenderer::loadTextureData() {
 	glTextures = new Texture*[texheader->numtextures];
 	memset(glTextures, 0, sizeof(Texture*)* texheader->numtextures);
 
+	if (paletted) {
+		glPalettes = new Texture*[texheader->numtextures];
+		memset(glPalettes, 0, sizeof(Texture*) * texheader->numtextures);
+	}
+
+	remapRanges.resize(texheader->numtextures);
+	remappable.resize(texheader->numtextures);
+
 	for (int i = 0; i < texheader->numtextures; i++) {
 		texdata.seek(texheader->textureindex + i * sizeof(mstudiotexture_t));
 		if (texdata.eom()) {
@@ -461,7 +709,32 @@ bool MdlRenderer::loadTextureData() {
 		texdata.seek(tex->index + imageDataSz);
 		COLOR3* palette = (COLOR3*)texdata.get();
 
-		if (tex->flags & STUDIO_NF_MASKED) {
+		// colors are remapped in the shader, which needs the original palette indexes
+		remappable[i] = paletted && parseRemapRange(tex->name, remapRanges[i]);
+
+		if (paletted) {
+			uint8_t* indexData = new uint8_t[imageDataSz];
+			memcpy(indexData, srcData, imageDataSz);
+
+			// indexes can't be interpolated, so the shader filters the palette colors instead
+			glTextures[i] = new Texture(tex->width, tex->height, indexData);
+			glTextures[i]->format = GL_RED;
+			glTextures[i]->internalFormat = GL_R8;
+			glTextures[i]->farFilter = GL_NEAREST;
+
+			COLOR4* paletteData = new COLOR4[256];
+			for (int k = 0; k < 256; k++) {
+				paletteData[k] = COLOR4(palette[k], 255);
+			}
+			if (tex->flags & STUDIO_NF_MASKED) {
+				paletteData[255] = COLOR4(0, 0, 0, 0);
+			}
+
+			glPalettes[i] = new Texture(256, 1, paletteData);
+			glPalettes[i]->format = GL_RGBA;
+			glPalettes[i]->farFilter = GL_NEAREST;
+		}
+		else if (tex->flags & STUDIO_NF_MASKED) {
 			COLOR4* imageData = new COLOR4[imageDataSz];
 
 			for (int k = 0; k < imageDataSz; k++) {
@@ -492,26 +765,43 @@ bool MdlRenderer::loadTextureData() {
 	return true;
 }
 
+bool MdlRenderer::parseRemapRange(string texName, MdlRemapRange& range) {
+	texName = toLowerCase(texName);
+
+	if (texName == "dm_base.bmp") {
+		range = { 160, 191, 192, 223 };
+		return true;
+	}
+
+	// Remap<N>_<low>_<mid>_<high>: top color = low to mid, bottom color = mid+1 to high
+	int low, mid, high;
+	if (sscanf(texName.c_str(), "remap%*c_%d_%d_%d", &low, &mid, &high) == 3) {
+		low = clamp(low, 0, 255);
+		mid = clamp(mid, 0, 255);
+		high = clamp(high, 0, 255);
+		range = { low, mid, mid + 1, high };
+		return true;
+	}
+
+	return false;
+}
+
 bool MdlRenderer::loadSequenceData() {
 	if (!hasExternalSequences()) {
 		return true;
 	}
 
-	int lastDot = fpath.find_last_of(".");
-	string ext = fpath.substr(lastDot);
-	string basepath = fpath.substr(0, lastDot);
-
 	for (int i = 1; i < header->numseqgroups && i < MAXSTUDIOSEQUENCES; i++) {
 		string suffix = i < 10 ? "0" + to_string(i) : to_string(i);
-		string spath = basepath + suffix + ext;
+		string spath = getExternalModelPath(fpath, suffix);
 
-		if (!fileExists(spath)) {
+		if (!modelFileExists(spath)) {
 			printf("External sequence model not found: %s\n", spath.c_str());
 			return false;
 		}
 
 		int len;
-		char* buffer = loadFile(spath, len);
+		char* buffer = loadModelFile(spath, len);
 		if (!buffer) {
 			printf("Failed to load external texture model: %s\n", spath.c_str());
 			return false;
@@ -523,27 +813,49 @@ bool MdlRenderer::loadSequenceData() {
 	return true;
 }
 
+bool operator==(const EntRenderOpts& o1, const EntRenderOpts& o2) {
+	return o1.rendermode == o2.rendermode && o1.renderamt == o2.renderamt && o1.rendercolor == o2.rendercolor
+		&& o1.framerate == o2.framerate && o1.scale == o2.scale && o1.vp_type == o2.vp_type
+		&& o1.body == o2.body && o1.skin == o2.skin && o1.sequence == o2.sequence
+		&& o1.wireframe == o2.wireframe && o1.topcolor == o2.topcolor && o1.bottomcolor == o2.bottomcolor;
+}
+
+bool operator!=(const EntRenderOpts& o1, const EntRenderOpts& o2) {
+	return !(o1 == o2);
+}
+
+void boneVert::setNormal(vec3 n) {
+	normal[0] = (int8_t)clamp(roundf(n.x * 127.0f), -127.0f, 127.0f);
+	normal[1] = (int8_t)clamp(roundf(n.y * 127.0f), -127.0f, 127.0f);
+	normal[2] = (int8_t)clamp(roundf(n.z * 127.0f), -127.0f, 127.0f);
+}
+
+void boneVert::setUv(vec2 st) {
+	uv[0] = (int16_t)clamp(roundf(st.x), -32768.0f, 32767.0f);
+	uv[1] = (int16_t)clamp(roundf(st.y), -32768.0f, 32767.0f);
+}
+
 bool MdlRenderer::loadMeshes() {
 	int uiDrawnPolys = 0;
 	int meshBytes = 0;
 
-	meshBuffers = new MdlMeshRender * *[header->numbodyparts];
-	memset(meshBuffers, 0, sizeof(MdlMeshRender**) * header->numbodyparts);
+	vector<boneVert> allVerts;
+	vector<uint32_t> allIndexes;
+
+	meshBuffers = arena.alloc<MdlMeshRender**>(header->numbodyparts);
 
 	for (int b = 0; b < header->numbodyparts; b++) {
 		// Try loading required model info
 		data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
 		mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
 
-		meshBuffers[b] = new MdlMeshRender * [bod->nummodels];
-		memset(meshBuffers[b], 0, sizeof(MdlMeshRender*) * bod->nummodels);
+		meshBuffers[b] = arena.alloc<MdlMeshRender*>(bod->nummodels);
 
 		for (int m = 0; m < bod->nummodels; m++) {
 			data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
 			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
 
-			meshBuffers[b][m] = new MdlMeshRender[mod->nummesh];
-			memset(meshBuffers[b][m], 0, sizeof(MdlMeshRender) * mod->nummesh);
+			meshBuffers[b][m] = arena.alloc<MdlMeshRender>(mod->nummesh);
 
 			data.seek(mod->vertindex);
 			vec3* pstudioverts = (vec3*)data.get();
@@ -601,8 +913,6 @@ bool MdlRenderer::loadMeshes() {
 				int origNormIdx = 0;
 				int debugIdx = 0;
 
-				const float s = 1.0 / (float)texture->width;
-				const float t = 1.0 / (float)texture->height;
 
 				vector<MdlVert> mdlVerts;
 
@@ -648,20 +958,14 @@ bool MdlRenderer::loadMeshes() {
 
 						vert.color = vec4(pstudionorms[ptricmds[1]], 0);
 
-						if (texture->flags & STUDIO_NF_CHROME) {
-							// real UVs calculated in shader
-							vert.uv = vec2(0.5f, 0.5f);
-						}
-						else {
-							vert.uv = vec2(ptricmds[2] * s, ptricmds[3] * t);
-						}
-
 						// TODO: hmmm
 						//vert.color.w = m_pRenderInfo->flTransparency;
 
 						vert.pos = pstudioverts[ptricmds[0]];
 						vert.origVert = ptricmds[0];
 						vert.origNorm = ptricmds[1];
+						vert.s = ptricmds[2];
+						vert.t = ptricmds[3];
 						mdlVerts.push_back(vert);
 
 						totalElements++;
@@ -683,61 +987,175 @@ bool MdlRenderer::loadMeshes() {
 				//debugf("%d %d %d - %d polys, %d verts, %d render verts\n", b, m, k, totalElements / 3, mod->numverts, totalElements);
 
 				MdlMeshRender& render = meshBuffers[b][m][k];
+				render.flags = texture->flags;
+				render.shaderFlags = getShaderFlags(texture->flags);
+				render.firstVert = allVerts.size();
+				render.firstIndex = allIndexes.size();
+				render.numIndexes = totalElements;
 
-				render.origVerts = new short[totalElements];
-				render.origNorms = new short[totalElements];
-				render.transformVerts = new vec3[totalElements];
-
-				vector<boneVert> allVerts;
-				allVerts.reserve(totalElements);
+				// expanded strips and fans repeat vertices, so index the unique ones
+				unordered_map<uint64_t, uint32_t> vertIndexes;
+				vector<int> uniqueVerts; // index into mdlVerts
 
 				for (int i = 0; i < totalElements; i++) {
 					MdlVert& v = mdlVerts[i];
+					uint64_t key = (uint64_t)(uint16_t)v.origVert | ((uint64_t)(uint16_t)v.origNorm << 16)
+						| ((uint64_t)(uint16_t)v.s << 32) | ((uint64_t)(uint16_t)v.t << 48);
+
+					auto existing = vertIndexes.find(key);
+					uint32_t idx;
+
+					if (existing != vertIndexes.end()) {
+						idx = existing->second;
+					}
+					else {
+						idx = uniqueVerts.size();
+						vertIndexes[key] = idx;
+						uniqueVerts.push_back(i);
+					}
+
+					allIndexes.push_back(render.firstVert + idx);
+				}
+
+				render.numVerts = uniqueVerts.size();
+				render.origVerts = arena.alloc<short>(render.numVerts);
+				render.origNorms = arena.alloc<short>(render.numVerts);
+				render.transformVerts = arena.alloc<vec3>(render.numVerts);
+
+				for (int i = 0; i < render.numVerts; i++) {
+					MdlVert& v = mdlVerts[uniqueVerts[i]];
 					render.origVerts[i] = v.origVert;
 					render.transformVerts[i] = v.pos;
 					render.origNorms[i] = v.origNorm;
 
 					boneVert bvert;
 					bvert.pos = v.pos;
-					bvert.normal = v.color.xyz();
-					bvert.uv = v.uv;
-					bvert.bone = pvertbone[v.origVert] + 0.1f;
+					bvert.setNormal(v.color.xyz());
+					bvert.setUv(vec2(v.s, v.t)); // chrome UVs are replaced when drawn
+					bvert.bone = pvertbone[v.origVert];
 
 					allVerts.push_back(bvert);
 				}
 
-				MdlMeshRender& meshbuf = meshBuffers[b][m][k];
-				meshbuf.flags = texture->flags;
-				meshbuf.verts = new boneVert[totalElements];
-				meshbuf.numVerts = totalElements;
-				memcpy(meshbuf.verts, &allVerts[0], totalElements * sizeof(boneVert));
-				meshbuf.buffer = new VertexBuffer(shader, NORM_3F | TEX_2F | POS_3F, meshbuf.verts, meshbuf.numVerts);
-				meshbuf.buffer->addAttribute(1, GL_FLOAT, GL_FALSE, "vBone");
-				//meshBuffers[b][m][k].buffer->upload();
-
-				meshbuf.wireVerts = new wireBoneVert[totalElements*2];
-				int idx = 0;
-				for (int i = 0; i < totalElements; i += 3) {
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 0]);
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 1]);
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 1]);
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 2]);
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 2]);
-					meshbuf.wireVerts[idx++] = wireBoneVert(meshbuf.verts[i + 0]);
-				}
-				meshbuf.wireBuffer = new VertexBuffer(wireShader, POS_3F, meshbuf.wireVerts, meshbuf.numVerts*2);
-				meshbuf.wireBuffer->addAttribute(1, GL_FLOAT, GL_FALSE, "vBone");
+				meshBytes += render.numVerts * (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(boneVert))
+					+ totalElements * sizeof(uint32_t);
+			}
+		}
+	}
+
+	meshVerts = new boneVert[allVerts.size()];
+	meshIndexes = new uint32_t[allIndexes.size()];
+	if (allVerts.size())
+		memcpy(meshVerts, &allVerts[0], allVerts.size() * sizeof(boneVert));
+	if (allIndexes.size())
+		memcpy(meshIndexes, &allIndexes[0], allIndexes.size() * sizeof(uint32_t));
+
+	for (int b = 0; b < header->numbodyparts; b++) {
+		data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
+		mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
+
+		for (int m = 0; m < bod->nummodels; m++) {
+			data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
+			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
 
-				meshBytes += totalElements * (sizeof(uint16_t) + sizeof(uint16_t) + sizeof(boneVert) + sizeof(wireBoneVert)*2);
+			for (int k = 0; k < mod->nummesh; k++) {
+				MdlMeshRender& render = meshBuffers[b][m][k];
+				render.verts = meshVerts + render.firstVert;
 			}
 		}
 	}
 
+	// GLSL 1.20 has no integer attributes, so the bone index is converted to a float
+	meshBuffer = new VertexBuffer(shader, 0, meshVerts, allVerts.size());
+	meshBuffer->addAttribute(POS_3F, "vPosition");
+	meshBuffer->addAttribute(3, GL_BYTE, GL_TRUE, "vNormal");
+	meshBuffer->addAttribute(1, GL_UNSIGNED_BYTE, GL_FALSE, "vBone");
+	meshBuffer->addAttribute(2, GL_SHORT, GL_FALSE, "vTex");
+	meshBuffer->setIndexes(meshIndexes, allIndexes.size());
+
 	//debugf("Total polys: %d, Mesh kb: %d\n", uiDrawnPolys, (int)(meshBytes / 1024.0f));
 
 	return true;
 }
 
+void MdlRenderer::loadWireframe() {
+	vector<uint32_t> lines;
+
+	for (int b = 0; b < header->numbodyparts; b++) {
+		data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
+		mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
+
+		for (int m = 0; m < bod->nummodels; m++) {
+			data.seek(bod->modelindex + m * sizeof(mstudiomodel_t));
+			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
+
+			for (int k = 0; k < mod->nummesh; k++) {
+				MdlMeshRender& render = meshBuffers[b][m][k];
+				render.firstWireIndex = lines.size();
+
+				// Vertices are split at UV seams, so dedupe edges by the original mdl vertex instead.
+				// The first rendered vertex created from an mdl vertex represents the others.
+				short firstVert[MAXSTUDIOVERTS];
+				memset(firstVert, -1, sizeof(firstVert));
+
+				for (int i = 0; i < render.numVerts; i++) {
+					short orig = render.origVerts[i];
+					if (firstVert[orig] == -1)
+						firstVert[orig] = i;
+				}
+
+				unordered_set<uint32_t> edges;
+				uint32_t* tris = meshIndexes + render.firstIndex;
+
+				for (int i = 0; i + 2 < render.numIndexes; i += 3) {
+					for (int e = 0; e < 3; e++) {
+						short v1 = render.origVerts[tris[i + e] - render.firstVert];
+						short v2 = render.origVerts[tris[i + (e + 1) % 3] - render.firstVert];
+						if (v1 > v2) {
+							short temp = v1;
+							v1 = v2;
+							v2 = temp;
+						}
+
+						if (edges.insert((v1 << 16) | v2).second) {
+							lines.push_back(render.firstVert + firstVert[v1]);
+							lines.push_back(render.firstVert + firstVert[v2]);
+						}
+					}
+				}
+
+				render.numWireIndexes = lines.size() - render.firstWireIndex;
+			}
+		}
+	}
+
+	wireIndexes = new uint32_t[lines.size()];
+	if (lines.size())
+		memcpy(wireIndexes, &lines[0], lines.size() * sizeof(uint32_t));
+
+	// same layout as the triangle buffer, but only position and bone are used
+	wireBuffer = new VertexBuffer(wireShader, 0);
+	wireBuffer->addAttribute(POS_3F, "vPosition");
+	wireBuffer->addAttribute(3, GL_BYTE, GL_TRUE, NULL);
+	wireBuffer->addAttribute(1, GL_UNSIGNED_BYTE, GL_FALSE, "vBone");
+	wireBuffer->addAttribute(2, GL_SHORT, GL_FALSE, NULL);
+	wireBuffer->shareVertexData(meshBuffer);
+	wireBuffer->setIndexes(wireIndexes, lines.size());
+	wireBuffer->upload();
+
+	// edges never change
+	wireBuffer->setIndexes(NULL, lines.size());
+	delete[] wireIndexes;
+	wireIndexes = NULL;
+}
+
+void MdlRenderer::unloadWireframe() {
+	delete wireBuffer;
+	delete[] wireIndexes;
+	wireBuffer = NULL;
+	wireIndexes = NULL;
+}
+
 mstudioanim_t* MdlRenderer::GetAnim(mstudioseqdesc_t* pseqdesc) {
 	data.seek(header->seqgroupindex + pseqdesc->seqgroup*sizeof(mstudioseqgroup_t));
 	mstudioseqgroup_t* pseqgroup = (mstudioseqgroup_t*)data.get();
@@ -1283,15 +1701,16 @@ void MdlRenderer::untransformVerts() {
 					short oldVertIdx = buffer.origVerts[v];
 					short oldNormIdx = buffer.origNorms[v];
 					buffer.verts[v].pos = transformedVerts[oldVertIdx];
-					buffer.verts[v].normal = transformedNormals[oldNormIdx];
+					buffer.verts[v].setNormal(transformedNormals[oldNormIdx]);
 				}
-				buffer.buffer->upload();
 			}
 		}
 	}
+
+	meshBuffer->upload();
 }
 
-void MdlRenderer::transformVerts(int body, bool forRender, vec3 viewerOrigin, vec3 viewerRight, bool wireframe) {
+void MdlRenderer::transformVerts(int body, bool forRender, vec3 viewerOrigin, vec3 viewerRight) {
 	int modelIdx = 0;
 
 	int bodyValue = clamp(body, 0, 255);
@@ -1340,28 +1759,13 @@ void MdlRenderer::transformVerts(int body, bool forRender, vec3 viewerOrigin, ve
 						short oldVertIdx = buffer.origVerts[v];
 						short oldNormIdx = buffer.origNorms[v];
 						buffer.verts[v].pos = transformedVerts[oldVertIdx];
-						buffer.verts[v].normal = transformedNormals[oldNormIdx].flip();
+						buffer.verts[v].setNormal(transformedNormals[oldNormIdx].flip());
 					}
 
-					if (wireframe) {
-						int idx = 0;
-						for (int v = 0; v < buffer.numVerts; v+=3) {
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 0].pos;
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 1].pos;
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 1].pos;
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 2].pos;
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 2].pos;
-							buffer.wireVerts[idx++].pos = buffer.verts[v + 0].pos;
-						}
-						buffer.wireBuffer->upload();
-					}
-
-					if ((buffer.flags & STUDIO_NF_CHROME) && buffer.skinref < texheader->numtextures) {
-						Texture* tex = glTextures[buffer.skinref];
-
+					if ((buffer.flags & STUDIO_NF_CHROME) && buffer.skinref < numTextures) {
 						for (int v = 0; v < buffer.numVerts; v++) {
-							vec3 tNormal = buffer.verts[v].normal.flip();
-							int boneIdx = (int)buffer.verts[v].bone;
+							vec3 tNormal = transformedNormals[buffer.origNorms[v]];
+							int boneIdx = buffer.verts[v].bone;
 							float (&bone)[4][4] = m_bonetransform[boneIdx];
 
 							vec3 bonePos = vec3(bone[0][3], bone[1][3], bone[2][3]);
@@ -1371,16 +1775,20 @@ void MdlRenderer::transformVerts(int body, bool forRender, vec3 viewerOrigin, ve
 							vec3 chromeright = crossProduct(dir, chromeup).normalize();
 
 							// calc s coord
+							vec2 uv;
 							float n = dotProduct(tNormal, chromeright.flip());
-							buffer.verts[v].uv.x = (n + 1.0f) * 0.5f;
+							uv.x = (n + 1.0f) * 0.5f;
 
 							// calc t coord
 							n = dotProduct(tNormal, chromeup.flip());
-							buffer.verts[v].uv.y = (n + 1.0f) * 0.5f;
+							uv.y = (n + 1.0f) * 0.5f;
+
+							// fixed point instead of texels, to keep sub-texel precision and to work with
+							// any texture size the skin is remapped to
+							buffer.verts[v].setUv(uv * MDL_CHROME_UV_SCALE);
 						}
 					}
 
-					buffer.buffer->upload();
 				}
 				else {
 					for (int v = 0; v < buffer.numVerts; v++) {
@@ -1393,24 +1801,13 @@ void MdlRenderer::transformVerts(int body, bool forRender, vec3 viewerOrigin, ve
 			}
 		}
 	}
-}
 
-void MdlRenderer::draw(vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewerOrigin, vec3 viewerRight) {
-	glCheckError("entering MDL render");
-	
-	if (!valid) {
-		return;
+	if (forRender && shaders) {
+		meshBuffer->upload();
 	}
+}
 
-	bool legacyMode = legacy_mode;
-
-	if (legacyMode != oldLegacyMode && !legacyMode) {
-		SetUpBones(vec3(), opts.sequence, 0);
-		untransformVerts();
-		needTransform = true;
-	}
-	oldLegacyMode = legacyMode;
-
+void MdlRenderer::advanceFrame(EntRenderOpts& opts) {
 	uint64_t now = getEpochMillis();
 	if (lastDrawCall == 0) {
 		lastDrawCall = now;
@@ -1420,62 +1817,77 @@ void MdlRenderer::draw(vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewe
 
 	opts.sequence = clamp(opts.sequence, 0, header->numseq - 1);
 	mstudioseqdesc_t* seq = getSequence(opts.sequence);
-	if (seq && seq->numframes > 1) {
+	if (seq && seq->numframes > 1 && realtime) {
 		drawFrame += seq->fps * deltaTime;
 		drawFrame = normalizeRangef(drawFrame, 0.0f, seq->numframes - 1);
 	}
+}
 
-	glEnable(GL_BLEND);
-	shader->bind();
-
-	int defaultBlendFunc = GL_ONE_MINUS_SRC_ALPHA;
+bool MdlRenderer::setupScene(EntRenderOpts& opts) {
+	bool additive = false;
 
 	switch (opts.rendermode) {
 	default:
 	case RENDER_MODE_NORMAL:
-		defaultBlendFunc = GL_ONE_MINUS_SRC_ALPHA;
-		shader->setUniform("colorMult", vec4(1, 1, 1, 1));
+		scene.colorMult = vec4(1, 1, 1, 1);
 		break;
 	case RENDER_MODE_SOLID:
-		defaultBlendFunc = GL_ONE_MINUS_SRC_ALPHA;
-		shader->setUniform("colorMult", vec4(1, 1, 1, 1));
+		scene.colorMult = vec4(1, 1, 1, 1);
 		break;
 	case RENDER_MODE_COLOR:
-		defaultBlendFunc = GL_ONE_MINUS_SRC_ALPHA;
-		shader->setUniform("colorMult", vec4(opts.rendercolor.toVec(), opts.renderamt / 255.0f));
+		scene.colorMult = vec4(opts.rendercolor.toVec(), opts.renderamt / 255.0f);
 		break;
 	case RENDER_MODE_TEXTURE:
-		defaultBlendFunc = GL_ONE_MINUS_SRC_ALPHA;
-		shader->setUniform("colorMult", vec4(1, 1, 1, opts.renderamt / 255.0f));
+		scene.colorMult = vec4(1, 1, 1, opts.renderamt / 255.0f);
 		break;
 	case RENDER_MODE_GLOW:
-		defaultBlendFunc = GL_ONE;
-		shader->setUniform("colorMult", vec4(1, 1, 1, opts.renderamt / 255.0f));
+		additive = true;
+		scene.colorMult = vec4(1, 1, 1, opts.renderamt / 255.0f);
 		break;
 	case RENDER_MODE_ADDITIVE:
-		defaultBlendFunc = GL_ONE;
-		shader->setUniform("colorMult", vec4(1, 1, 1, opts.renderamt / 255.0f));
+		additive = true;
+		scene.colorMult = vec4(1, 1, 1, opts.renderamt / 255.0f);
 		break;
 	}
 
-	glBlendFunc(GL_SRC_ALPHA, defaultBlendFunc);
-	glDepthFunc(GL_LEQUAL);
-
-	shader->setUniform("sTex", 0);
-	shader->setUniform("elights", 1); // number of active lights
-	shader->setUniform("ambient", opts.rendercolor.toVec()); // ambient lighting
+	scene.ambient = opts.rendercolor.toVec(); // ambient lighting
 
 	// light data
-	vec3 lights[4][3];
-
 	for (int i = 0; i < 4; i++) {
-		memset(lights[i], 0, 3*sizeof(vec3));
+		memset(scene.lights[i], 0, 3*sizeof(vec3));
 	}
 	float shadelight = 192.0f / 255.0f; // value used in HLMV
-	lights[0][0] = vec3(0, 1024, 0); // light position
-	lights[0][1] = opts.rendercolor.toVec() * shadelight; // diffuse color
-	shader->setUniform("lights", (float*)lights, 4*3*3);
-	glCheckError("setting MDL scene uniforms");
+	scene.lights[0][0] = vec3(0, 1024, 0); // light position
+	scene.lights[0][1] = opts.rendercolor.toVec() * shadelight; // diffuse color
+
+	return additive;
+}
+
+void MdlRenderer::draw(vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewerOrigin, vec3 viewerRight) {
+	glCheckError("entering MDL render");
+	
+	if (!valid) {
+		return;
+	}
+
+	bool legacyMode = legacy_mode;
+
+	if (legacyMode != oldLegacyMode && !legacyMode) {
+		SetUpBones(vec3(), opts.sequence, 0);
+		untransformVerts();
+		needTransform = true;
+	}
+	oldLegacyMode = legacyMode;
+
+	advanceFrame(opts);
+
+	glEnable(GL_BLEND);
+	boundShader = NULL;
+
+	int defaultBlendFunc = setupScene(opts) ? GL_ONE : GL_ONE_MINUS_SRC_ALPHA;
+
+	glBlendFunc(GL_SRC_ALPHA, defaultBlendFunc);
+	glDepthFunc(GL_LEQUAL);
 
 	shader->pushMatrix(MAT_MODEL);
 	shader->modelMat->loadIdentity();
@@ -1484,141 +1896,334 @@ void MdlRenderer::draw(vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewe
 	if (!legacyMode) {
 		SetUpBones(angles, opts.sequence, drawFrame);
 
-		shader->setUniform("viewerOrigin", (viewerOrigin - origin).flip()); // world coordinates
-		shader->setUniform("viewerRight", viewerRight * -1);
+		scene.viewerOrigin = (viewerOrigin - origin).flip(); // world coordinates
+		scene.viewerRight = viewerRight * -1;
 
 		// Hack: upload bone matrices as texture pixels.
 		// Opengl 3.0 doesn't have uniform buffers and mat4[128] is far too many uniforms for a valid shader.
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, u_boneTexture);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, MAXSTUDIOBONES, GL_RGBA, GL_FLOAT, m_bonetransform);
-		shader->setUniform("boneMatrixTexture", 1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 4, numBones, GL_RGBA, GL_FLOAT, m_bonetransform);
 	}
 	else {
-		shader->setUniform("chromeEnable", 0);
-
 		// no way to upload bone data. Do transforms on the CPU (slow!!)
 		// TODO: chrome is wrong, check goldenman.mdl
 		SetUpBones(angles, opts.sequence, drawFrame);
 
 		vec3 viewOrigin = (viewerOrigin - origin).flip();
-		transformVerts(opts.body, true, viewOrigin, viewerRight*-1, opts.wireframe);
+		transformVerts(opts.body, true, viewOrigin, viewerRight*-1);
 		needTransform = true;
 	}
 	glActiveTexture(GL_TEXTURE0);
 
 	// Don't rotate the scene because it messes up chrome effect.
-	shader->updateMatrixes();
+	// Matrices are uploaded when each shader variant is bound.
 
 	glCheckError("updating MDL bone texture");
 
-	data.seek(header->skinindex);
-	
 	int skin = clamp(opts.skin, 0, header->numskinfamilies-1);
-	short* pskinref = (short*)data.get();
+	int body = clamp(opts.body, 0, 255);
 
-	int bodyValue = clamp(opts.body, 0, 255);
-
-	for (int pass = 0; pass < 2; pass++) {
-		// render additive meshes last
-		bool isAdditivePass = pass == 1;
-		glBlendFunc(GL_SRC_ALPHA, isAdditivePass ? GL_ONE : defaultBlendFunc);
-		shader->setUniform("additiveEnable", isAdditivePass);
-
-		for (int b = 0; b < header->numbodyparts; b++) {
-			// Try loading required model info
-			data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
-			mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
-
-			int activeModel = (bodyValue / bod->base) % bod->nummodels;
-			bodyValue -= activeModel * bod->base;
-
-			data.seek(bod->modelindex + activeModel * sizeof(mstudiomodel_t));
-			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
-
-			for (int k = 0; k < mod->nummesh; k++) {
-				MdlMeshRender& render = meshBuffers[b][activeModel][k];
-
-				if (!render.buffer) {
-					continue;
-				}
+	if (body != drawListBody || skin != drawListSkin) {
+		buildDrawList(body, skin);
+	}
 
-				bool isAdditive = render.flags & STUDIO_NF_ADDITIVE;
-				if (isAdditive != isAdditivePass) {
-					continue;
-				}
+	int lastPass = -1;
+	Texture* lastTex = NULL;
 
-				short remappedSkin = pskinref[skin * header->numskinref + render.skinref];
-				if (remappedSkin < 0 || remappedSkin >= header->numtextures) {
-					remappedSkin = render.skinref;
-				}
+	// team colors are converted to hue angles, like in the game
+	bool recolor = opts.topcolor >= 0 || opts.bottomcolor >= 0;
+	vec2 hues = vec2(opts.topcolor * (360.0f / 255.0f), opts.bottomcolor * (360.0f / 255.0f));
 
-				Texture* tex = glTextures[remappedSkin];
-				tex->bind();
+	meshBuffer->bind();
 
-				int flatShade = 0;
-				if (render.flags & STUDIO_NF_FULLBRIGHT) {
-					flatShade = 2;
-				}
-				else if (render.flags & STUDIO_NF_FLATSHADE) {
-					flatShade = 1;
-				}
+	for (int i = 0; i < drawList.size(); i++) {
+		MdlDrawItem& item = drawList[i];
+		MdlMeshRender& render = *item.render;
 
-				shader->setUniform("flatshadeEnable", flatShade);
+		if (item.pass != lastPass) {
+			// render additive meshes last
+			glBlendFunc(GL_SRC_ALPHA, item.pass == 1 ? GL_ONE : defaultBlendFunc);
+			lastPass = item.pass;
+		}
 
-				if (!legacyMode) {
-					shader->setUniform("chromeEnable", (render.flags & STUDIO_NF_CHROME) ? 1 : 0);
-				}
+		if (item.tex != lastTex) {
+			if (item.palette) {
+				glActiveTexture(GL_TEXTURE2);
+				item.palette->bind();
+				glActiveTexture(GL_TEXTURE0);
+			}
+			item.tex->bind();
+			lastTex = item.tex;
+		}
 
-				render.buffer->draw(GL_TRIANGLES);
+		ShaderProgram* variant;
+		if (item.remap && recolor) {
+			variant = bindShader(item.shaderFlags);
+			MdlRemapRange& r = *item.remap;
+			vec4 ranges = vec4(r.topLow, r.topHigh, r.bottomLow, r.bottomHigh);
+			if (opts.topcolor < 0) {
+				ranges.x = 256; // empty range
 			}
+			if (opts.bottomcolor < 0) {
+				ranges.z = 256;
+			}
+			variant->setUniform(u.remapRanges, ranges);
+			variant->setUniform(u.remapHues, hues);
+		}
+		else {
+			variant = bindShader(item.shaderFlags & ~MDL_SHADER_REMAP);
 		}
+
+		variant->setUniform(u.uvScale, item.uvScale);
+		if (item.palette) {
+			variant->setUniform(u.texSize, vec2(item.tex->width, item.tex->height));
+		}
+
+		meshBuffer->drawBoundRange(GL_TRIANGLES, render.firstIndex, render.firstIndex + render.numIndexes);
 	}
 
+	meshBuffer->unbind();
+
 	shader->popMatrix(MAT_MODEL);
 
 	if (opts.wireframe) {
+		if (!wireBuffer) {
+			loadWireframe();
+		}
+
 		wireShader->bind();
-		wireShader->setUniform("wireColor", vec4(1, 0, 0, 1));
+		wireShader->setUniform(u.wireColor, vec4(1, 0, 0, 1));
 
 		if (!legacyMode)
-			wireShader->setUniform("boneMatrixTexture", 1);
+			wireShader->setUniform(u.wireBoneMatrixTexture, 1);
 
 		wireShader->pushMatrix(MAT_MODEL);
 		wireShader->modelMat->loadIdentity();
 		wireShader->modelMat->translate(origin.x, origin.z, -origin.y);
 		wireShader->updateMatrixes();
-	
-		for (int b = 0; b < header->numbodyparts; b++) {
-			// Try loading required model info
-			data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
-			mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
-
-			int activeModel = (bodyValue / bod->base) % bod->nummodels;
-			bodyValue -= activeModel * bod->base;
-
-			data.seek(bod->modelindex + activeModel * sizeof(mstudiomodel_t));
-			mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
 
-			for (int k = 0; k < mod->nummesh; k++) {
-				MdlMeshRender& render = meshBuffers[b][activeModel][k];
+		wireBuffer->bind();
 
-				if (!render.buffer) {
-					continue;
-				}
+		for (int i = 0; i < drawList.size(); i++) {
+			MdlMeshRender& render = *drawList[i].render;
 
-				render.wireBuffer->draw(GL_LINES);
+			if (render.numWireIndexes) {
+				wireBuffer->drawBoundRange(GL_LINES, render.firstWireIndex, render.firstWireIndex + render.numWireIndexes);
 			}
 		}
 
+		wireBuffer->unbind();
+
 		wireShader->popMatrix(MAT_MODEL);
 	}
+	else if (wireBuffer) {
+		unloadWireframe();
+	}
 
 	//printf("Draw %d meshes\n", meshCount);
 
 	glCheckError("rendering model");
 }
 
+void MdlRenderer::drawSoftware(SoftRasterizer* rast, const mat4x4& viewProjection, vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewerOrigin, vec3 viewerRight) {
+	if (!valid) {
+		return;
+	}
+
+	advanceFrame(opts);
+	bool additiveMode = setupScene(opts);
+
+	mat4x4 modelMat;
+	modelMat.loadIdentity();
+	modelMat.translate(origin.x, origin.z, -origin.y);
+
+	SoftDrawState state;
+	state.modelViewProjection = viewProjection * modelMat;
+	state.colorMult = scene.colorMult;
+	state.ambient = scene.ambient;
+	memcpy(state.lights, scene.lights, sizeof(scene.lights));
+	state.elights = 1;
+
+	SetUpBones(angles, opts.sequence, drawFrame);
+	vec3 viewOrigin = (viewerOrigin - origin).flip();
+	transformVerts(opts.body, true, viewOrigin, viewerRight*-1);
+	needTransform = true;
+
+	int skin = clamp(opts.skin, 0, header->numskinfamilies-1);
+	int body = clamp(opts.body, 0, 255);
+
+	if (body != drawListBody || skin != drawListSkin) {
+		buildDrawList(body, skin);
+	}
+
+	bool recolor = opts.topcolor >= 0 || opts.bottomcolor >= 0;
+	state.remapHues = vec2(opts.topcolor * (360.0f / 255.0f), opts.bottomcolor * (360.0f / 255.0f));
+
+	for (int i = 0; i < drawList.size(); i++) {
+		MdlDrawItem& item = drawList[i];
+		MdlMeshRender& render = *item.render;
+
+		state.tex = item.tex;
+		state.palette = item.palette;
+		state.uvScale = item.uvScale;
+		state.flags = item.shaderFlags;
+		state.additiveBlend = item.pass == 1 || additiveMode;
+
+		if (item.remap && recolor) {
+			MdlRemapRange& r = *item.remap;
+			state.remapRanges = vec4(opts.topcolor < 0 ? 256 : r.topLow, r.topHigh, opts.bottomcolor < 0 ? 256 : r.bottomLow, r.bottomHigh);
+		}
+		else {
+			state.flags &= ~MDL_SHADER_REMAP;
+		}
+
+		rast->drawTriangles(state, meshVerts, meshIndexes + render.firstIndex, render.numIndexes);
+	}
+}
+
+void MdlRenderer::buildDrawList(int body, int skin) {
+	drawList.clear();
+	drawListBody = body;
+	drawListSkin = skin;
+
+	data.seek(header->skinindex);
+	short* pskinref = (short*)data.get();
+
+	int bodyValue = body;
+
+	for (int b = 0; b < header->numbodyparts; b++) {
+		// Try loading required model info
+		data.seek(header->bodypartindex + b * sizeof(mstudiobodyparts_t));
+		mstudiobodyparts_t* bod = (mstudiobodyparts_t*)data.get();
+
+		int activeModel = (bodyValue / bod->base) % bod->nummodels;
+		bodyValue -= activeModel * bod->base;
+
+		data.seek(bod->modelindex + activeModel * sizeof(mstudiomodel_t));
+		mstudiomodel_t* mod = (mstudiomodel_t*)data.get();
+
+		for (int k = 0; k < mod->nummesh; k++) {
+			MdlMeshRender& render = meshBuffers[b][activeModel][k];
+
+			if (!render.numIndexes) {
+				continue;
+			}
+
+			short remappedSkin = pskinref[skin * header->numskinref + render.skinref];
+			if (remappedSkin < 0 || remappedSkin >= header->numtextures) {
+				remappedSkin = render.skinref;
+			}
+
+			MdlDrawItem item;
+			item.render = &render;
+			item.tex = glTextures[remappedSkin];
+			item.palette = glPalettes ? glPalettes[remappedSkin] : NULL;
+			item.remap = remappable[remappedSkin] ? &remapRanges[remappedSkin] : NULL;
+			item.shaderFlags = render.shaderFlags | (item.remap ? MDL_SHADER_REMAP : 0);
+			item.pass = (render.flags & STUDIO_NF_ADDITIVE) ? 1 : 0;
+
+			if (!item.tex) {
+				continue; // failed to load
+			}
+
+			if (render.flags & STUDIO_NF_CHROME) {
+				item.uvScale = vec2(1.0f, 1.0f) / MDL_CHROME_UV_SCALE;
+			}
+			else {
+				item.uvScale = vec2(1.0f / item.tex->width, 1.0f / item.tex->height);
+			}
+
+			drawList.push_back(item);
+		}
+	}
+
+	// group draws so that blend modes, shaders, and textures change as little as possible
+	std::stable_sort(drawList.begin(), drawList.end(), [](const MdlDrawItem& a, const MdlDrawItem& b) {
+		if (a.pass != b.pass)
+			return a.pass < b.pass;
+		if (a.shaderFlags != b.shaderFlags)
+			return a.shaderFlags < b.shaderFlags;
+		return a.tex < b.tex;
+	});
+}
+
+int MdlRenderer::getShaderFlags(int textureFlags) {
+	int flags = 0;
+
+	// additive and fullbright meshes are unlit, which overrides flat shading
+	if (textureFlags & STUDIO_NF_ADDITIVE) {
+		flags |= MDL_SHADER_ADDITIVE;
+	}
+	else if (textureFlags & STUDIO_NF_FULLBRIGHT) {
+		flags |= MDL_SHADER_FULLBRIGHT;
+	}
+	else if (textureFlags & STUDIO_NF_FLATSHADE) {
+		flags |= MDL_SHADER_FLATSHADE;
+	}
+
+	if ((textureFlags & STUDIO_NF_CHROME) && !legacy_mode) {
+		flags |= MDL_SHADER_CHROME;
+	}
+
+	if (textureFlags & STUDIO_NF_MASKED) {
+		flags |= MDL_SHADER_MASKED;
+	}
+
+	if (paletted) {
+		flags |= MDL_SHADER_PALETTED;
+	}
+
+	return flags;
+}
+
+ShaderProgram* MdlRenderer::bindShader(int flags) {
+	ShaderProgram* variant = shaders->get(flags);
+
+	if (variant == boundShader) {
+		return variant;
+	}
+
+	// each variant has its own uniform state. Unchanged values are skipped by the uniform shadows.
+	variant->bind();
+	variant->setUniform(u.sTex, 0);
+	variant->setUniform(u.sPalette, 2);
+	variant->setUniform(u.elights, 1); // number of active lights
+	variant->setUniform(u.ambient, scene.ambient);
+	variant->setUniform(u.lights, (float*)scene.lights, 4*3*3);
+	variant->setUniform(u.colorMult, scene.colorMult);
+
+	if (!legacy_mode) {
+		variant->setUniform(u.viewerOrigin, scene.viewerOrigin);
+		variant->setUniform(u.viewerRight, scene.viewerRight);
+		variant->setUniform(u.boneMatrixTexture, 1);
+	}
+
+	variant->updateMatrixes();
+	glCheckError("setting MDL scene uniforms");
+
+	boundShader = variant;
+	return variant;
+}
+
+float MdlRenderer::getSequenceFps(int sequence) {
+	if (!valid || header->numseq <= 0) {
+		return 0;
+	}
+
+	mstudioseqdesc_t* seq = getSequence(clamp(sequence, 0, header->numseq - 1));
+	return seq && seq->numframes > 1 ? seq->fps : 0;
+}
+
+int MdlRenderer::getSequenceFrames(int sequence) {
+	if (!valid || header->numseq <= 0) {
+		return 0;
+	}
+
+	mstudioseqdesc_t* seq = getSequence(clamp(sequence, 0, header->numseq - 1));
+	return seq ? seq->numframes : 0;
+}
+
 // get a AABB containing all model vertices at the given angles and animation frame
 void MdlRenderer::getModelBoundingBox(vec3 angles, int sequence, vec3& mins, vec3& maxs) {
 	sequence = clamp(sequence, 0, header->numseq - 1);
@@ -3,47 +3,81 @@
 #include "mstream.h"
 #include "Texture.h"
 #include "VertexBuffer.h"
+#include "ShaderVariants.h"
+#include "arena.h"
 #include <future>
 
 #define	EQUAL_EPSILON	0.001f
+#define MDL_CHROME_UV_SCALE	16384.0f // chrome coordinates calculated on the CPU are stored as 0-1 fixed point
 
 struct MdlVert {
 	vec3 pos;
-	vec2 uv;
 	vec4 color;
 	short origVert;
 	short origNorm;
+	short s, t; // original texture coordinates
 };
 
+// packed vertex format for rendering (20 bytes)
 struct boneVert {
-	vec2 uv;
-	vec3 normal;
 	vec3 pos;
-	float bone;
+	int8_t normal[3]; // unit normal scaled to -127 to 127
+	uint8_t bone;
+	int16_t uv[2]; // texture coordinates in texels, or fixed point for chrome (see MdlDrawItem::uvScale)
+
+	void setNormal(vec3 n);
+	void setUv(vec2 st);
 };
 
-struct wireBoneVert {
-	vec3 pos;
-	float bone;
+// feature flags for MDL shader variants
+enum mdl_shader_flags {
+	MDL_SHADER_CHROME = 1,
+	MDL_SHADER_ADDITIVE = 2,
+	MDL_SHADER_FLATSHADE = 4,
+	MDL_SHADER_FULLBRIGHT = 8,
+	MDL_SHADER_MASKED = 16,
+	MDL_SHADER_PALETTED = 32,
+	MDL_SHADER_REMAP = 64,
+};
 
-	wireBoneVert() {}
-	wireBoneVert(boneVert& vert) {
-		this->pos = vert.pos;
-		this->bone = vert.bone;
-	}
+// palette index ranges recolored with the top and bottom colors (GoldSrc player colors)
+struct MdlRemapRange {
+	int topLow, topHigh; // inclusive. high < low if there is no top color range
+	int bottomLow, bottomHigh;
 };
 
 struct MdlMeshRender {
-	boneVert* verts; // rendered vertices
-	wireBoneVert* wireVerts; // wireframe rendering
+	boneVert* verts; // rendered vertices (points into the model vertex buffer)
 	short* origVerts; // original mdl vertex used to create the rendered vertex
 	vec3* transformVerts; // duplicate of verts positions that can be edited before/after buffers upload
 	short* origNorms; // original mdl normals used to create the rendered normal
 	int numVerts;
+	int firstVert; // offset of verts in the model vertex buffer
+	int firstIndex; // offset of the triangle indexes in the model index buffer
+	int numIndexes;
+	int firstWireIndex; // offset of the edge indexes in the wireframe index buffer
+	int numWireIndexes;
 	int flags;
+	int shaderFlags; // MDL_SHADER_* flags for the mesh texture
 	int skinref; // index into glTextures or remappable skin
-	VertexBuffer* buffer;
-	VertexBuffer* wireBuffer;
+};
+
+// a mesh to render for the current body and skin
+struct MdlDrawItem {
+	MdlMeshRender* render;
+	Texture* tex; // skin texture after remapping
+	Texture* palette; // palette for tex, if textures are paletted
+	MdlRemapRange* remap; // color ranges of the texture, if it is remappable
+	int shaderFlags; // mesh shader flags, plus flags for the remapped texture
+	vec2 uvScale; // converts boneVert::uv to texture coordinates for tex
+	int pass; // 0 = normal, 1 = additive
+};
+
+// a model file that the caller already loaded. data must be allocated with new[].
+struct MdlFileBuffer {
+	string path;
+	char* data;
+	int len;
 };
 
 struct EntRenderOpts {
@@ -57,8 +91,14 @@ struct EntRenderOpts {
 	int skin;
 	int sequence;
 	bool wireframe;
+	int topcolor; // hue (0-255) for remappable textures, or -1 to keep the original colors
+	int bottomcolor;
 };
 
+// compares every field (memcmp would also compare padding bytes, which copies don't preserve)
+bool operator==(const EntRenderOpts& o1, const EntRenderOpts& o2);
+bool operator!=(const EntRenderOpts& o1, const EntRenderOpts& o2);
+
 enum render_modes {
 	RENDER_MODE_NORMAL,
 	RENDER_MODE_COLOR,
@@ -69,6 +109,7 @@ enum render_modes {
 };
 
 class Entity;
+class SoftRasterizer;
 
 class MdlRenderer {
 public:
@@ -84,21 +125,44 @@ public:
 	int drawBody;
 	float drawFrame = 0;
 	uint64_t lastDrawCall = 0;
+	bool realtime = true; // advance drawFrame by the time since the last draw call
 
-	MdlRenderer(ShaderProgram* shader, ShaderProgram* wireShader, bool legacy_mode, string modelPath);
+	// paletted = upload textures as 8-bit color indexes with a 256x1 palette texture,
+	// instead of expanding them to RGB(A). Colors are looked up in the fragment shader.
+	// Call loadData() and then upload() to load the model.
+	// shaders and wireShader are NULL for models drawn with drawSoftware, which skip uploading.
+	MdlRenderer(ShaderVariants* shaders, ShaderProgram* wireShader, bool legacy_mode, bool paletted, string modelPath);
 	~MdlRenderer();
 
 	void draw(vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewerOrigin, vec3 viewerRight);
 
+	// queue the model for drawing with a CPU rasterizer, using the legacy (CPU skinning) path.
+	// Wireframes aren't supported.
+	void drawSoftware(SoftRasterizer* rast, const mat4x4& viewProjection, vec3 origin, vec3 angles, EntRenderOpts& opts, vec3 viewerOrigin, vec3 viewerRight);
+
 	void upload(); // called by main thread to upload data to gpu
 
+	// memory used by this model, not including shared shaders
+	size_t getResidentBytes(); // CPU memory
+	size_t getGpuBytes(); // textures and buffers
+
 	// get a AABB containing all possible vertices in the given animation with given angles
 	void getModelBoundingBox(vec3 angles, int sequence, vec3& mins, vec3& maxs);
+	float getSequenceFps(int sequence); // 0 if the sequence doesn't animate
+	int getSequenceFrames(int sequence);
 
 	bool isStudioModel() { return true; };
 
+	string getPath() { return fpath; }
+	string getHash() { return hash; } // md5 of the model file (same as the model info json)
+
+	// read and parse the model files. Doesn't use OpenGL, so it's safe to call from a worker thread.
 	void loadData();
 
+	// Use an in-memory file instead of reading it from disk (for the model, its texture model,
+	// or its sequence groups). The renderer takes ownership of the data. Add before loadData().
+	void addFileBuffer(MdlFileBuffer file);
+
 	// functions copied from Solokiller's model viewer
 	void CalcBones(vec3* pos, vec4* q, const mstudioseqdesc_t* const pseqdesc, const mstudioanim_t* panim, const float f, bool isGait);
 	void CalcBoneQuaternion(const int frame, const float s, const mstudiobone_t* const pbone, const mstudioanim_t* const panim, vec4& q);
@@ -109,12 +173,48 @@ public:
 
 private:
 	string fpath;
+	string hash;
 	bool legacy_mode;
+	bool paletted;
 
-	ShaderProgram* shader;
+	ShaderVariants* shaders;
+	ShaderProgram* shader; // variant without any features, for loading buffers and shared state
 	ShaderProgram* wireShader;
+
+	// uniform handles, resolved once so drawing doesn't do string lookups
+	struct {
+		UniformHandle sTex, sPalette, texSize, uvScale, elights, ambient, lights, colorMult;
+		UniformHandle remapRanges, remapHues;
+		UniformHandle viewerOrigin, viewerRight, boneMatrixTexture;
+		UniformHandle wireColor, wireBoneMatrixTexture;
+	} u;
+
+	// uniform values for the current draw call, set on each shader variant as it's bound
+	struct {
+		vec4 colorMult;
+		vec3 ambient;
+		vec3 lights[4][3];
+		vec3 viewerOrigin;
+		vec3 viewerRight;
+	} scene;
+	ShaderProgram* boundShader = NULL;
+
+	// meshes to draw for the current body and skin, sorted by pass, shader, and texture
+	vector<MdlDrawItem> drawList;
+	int drawListBody = -1;
+	int drawListSkin = -1;
 	Texture** glTextures = NULL;
+	Texture** glPalettes = NULL; // palette for each texture in glTextures (paletted mode only)
+	vector<MdlRemapRange> remapRanges; // color ranges for each texture. Remapping requires paletted textures.
+	vector<bool> remappable;
 	MdlMeshRender*** meshBuffers = NULL;
+
+	// all meshes share one vertex and index buffer and are drawn as index ranges
+	boneVert* meshVerts = NULL;
+	uint32_t* meshIndexes = NULL;
+	VertexBuffer* meshBuffer = NULL;
+	uint32_t* wireIndexes = NULL; // unique triangle edges, as line indexes into meshVerts
+	VertexBuffer* wireBuffer = NULL; // draws wireIndexes using the vertex data in meshBuffer (allocated on first wireframe draw)
 	int numTextures;
 
 	studiohdr_t* header = NULL;
@@ -132,22 +232,37 @@ private:
 		vec3 mins, maxs;
 		bool isCached;
 	};
-	AABB cachedBounds[MAXSTUDIOANIMATIONS]; // cached results for getModelBoundingBox
+
+	// Working memory for this model, sized from the header at load time. Freed all at once
+	// with the renderer. Buffers that are freed after uploading are allocated separately.
+	Arena arena;
+	int numBones; // size of the bone arrays
+	int maxModelVerts = 0; // most vertices/normals referenced by any model
+	int maxModelNorms = 0;
+
+	AABB* cachedBounds = NULL; // cached results for getModelBoundingBox, per sequence
 
 	// for setupbones
-	vec3 pos[MAXSTUDIOBONES];
-	vec4 q[MAXSTUDIOBONES];
-	vec3 pos2[MAXSTUDIOBONES];
-	vec4 q2[MAXSTUDIOBONES];
-	vec3 pos3[MAXSTUDIOBONES];
-	vec4 q3[MAXSTUDIOBONES];
-	vec3 pos4[MAXSTUDIOBONES];
-	vec4 q4[MAXSTUDIOBONES];
+	vec3* pos = NULL;
+	vec4* q = NULL;
+	vec3* pos2 = NULL;
+	vec4* q2 = NULL;
+	vec3* pos3 = NULL;
+	vec4* q3 = NULL;
+	vec3* pos4 = NULL;
+	vec4* q4 = NULL;
 
 	// for transformverts
-	vec3 transformedVerts[MAXSTUDIOVERTS];
-	vec3 transformedNormals[MAXSTUDIOVERTS];
+	vec3* transformedVerts = NULL;
+	vec3* transformedNormals = NULL;
 
+	unordered_map<string, MdlFileBuffer> fileBuffers; // files not yet claimed by the loader
+	char* loadModelFile(const string& path, int& len); // returns an in-memory file, or reads from disk
+	bool modelFileExists(const string& path);
+	void allocWorkingMemory(); // size per-model buffers from the header
+	bool validateBoneRefs(int offset, int count, const char* desc);
+	void freeUploadedData(); // delete CPU copies of data that only the GPU needs now
+	void trimTextureData(); // drop texture pixels from the end of the model data
 	bool loadTextureData();
 	bool loadSequenceData();
 	bool loadMeshes();
@@ -156,14 +271,22 @@ private:
 	bool validate();
 	bool hasExternalTextures();
 	bool hasExternalSequences();
-	void transformVerts(int body, bool forRender, vec3 viewerOrigin=vec3(), vec3 viewerRight=vec3(1,0,0), bool wireframe=false);
+	void transformVerts(int body, bool forRender, vec3 viewerOrigin=vec3(), vec3 viewerRight=vec3(1,0,0));
 	void untransformVerts();
+	void loadWireframe(); // create the edge buffer for all meshes
+	void unloadWireframe();
+	void buildDrawList(int body, int skin);
+	int getShaderFlags(int textureFlags); // MDL_SHADER_* flags for a texture
+	bool parseRemapRange(string texName, MdlRemapRange& range);
+	ShaderProgram* bindShader(int flags); // bind a shader variant and set the scene uniforms
+	void advanceFrame(EntRenderOpts& opts); // animate using the time since the last draw
+	bool setupScene(EntRenderOpts& opts); // set lighting and color uniforms. Returns true for additive render modes.
 
 	// frame values = 0 - 1.0 (0-100%)
 	// angles = rotation for the entire model (y = pitch, z = yaw)
 	void SetUpBones(vec3 angles, int sequence, float frame, int gaitsequence = -1, float gaitframe = 0);
 	
-	float m_bonetransform[MAXSTUDIOBONES][4][4];	// bone transformation matrix (3x4)
+	float (*m_bonetransform)[4][4] = NULL;	// bone transformation matrix (3x4), per bone
 
 	mstudioanim_t* GetAnim(mstudioseqdesc_t* pseqdesc);
 	mstudioseqdesc_t* getSequence(int seq);
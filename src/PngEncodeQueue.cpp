@@ -0,0 +1,100 @@
+#include "PngEncodeQueue.h"
+#include "util.h"
+#include "lodepng.h"
+#include <algorithm>
+
+PngEncodeQueue::PngEncodeQueue(int numThreads, int maxQueued) {
+	if (numThreads <= 0) {
+		numThreads = max(1, (int)std::thread::hardware_concurrency());
+	}
+	this->numThreads = numThreads;
+	this->maxQueued = maxQueued > 0 ? maxQueued : numThreads * 2;
+
+	for (int i = 0; i < numThreads; i++) {
+		workers.push_back(std::thread(&PngEncodeQueue::workerLoop, this));
+	}
+}
+
+PngEncodeQueue::~PngEncodeQueue() {
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		stopping = true;
+	}
+	jobAdded.notify_all();
+
+	for (int i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+}
+
+std::vector<uint8_t> PngEncodeQueue::acquire(size_t bytes) {
+	std::vector<uint8_t> buffer;
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		if (!bufferPool.empty()) {
+			buffer = std::move(bufferPool.back());
+			bufferPool.pop_back();
+		}
+	}
+
+	buffer.resize(bytes);
+	return buffer;
+}
+
+void PngEncodeQueue::submit(std::string path, int width, int height, std::vector<uint8_t>&& pixels,
+	std::function<void(bool)> onSaved) {
+	std::unique_lock<std::mutex> guard(queueLock);
+	jobDone.wait(guard, [this] { return queue.size() < maxQueued; });
+
+	Job job;
+	job.path = path;
+	job.width = width;
+	job.height = height;
+	job.pixels = std::move(pixels);
+	job.onSaved = onSaved;
+	queue.push_back(std::move(job));
+	peakDepth = max(peakDepth, (int)queue.size());
+
+	guard.unlock();
+	jobAdded.notify_one();
+}
+
+void PngEncodeQueue::finish() {
+	std::unique_lock<std::mutex> guard(queueLock);
+	jobDone.wait(guard, [this] { return queue.empty() && activeJobs == 0; });
+}
+
+void PngEncodeQueue::workerLoop() {
+	while (true) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> guard(queueLock);
+			jobAdded.wait(guard, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) {
+				return; // stopping and nothing left to do
+			}
+			job = std::move(queue.front());
+			queue.pop_front();
+			activeJobs++;
+		}
+		jobDone.notify_all(); // room for another job
+
+		unsigned error = lodepng_encode32_file(job.path.c_str(), &job.pixels[0], job.width, job.height);
+		if (error) {
+			printf("Failed to write %s: %s\n", job.path.c_str(), lodepng_error_text(error));
+		}
+		if (job.onSaved) {
+			job.onSaved(error == 0);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(queueLock);
+			// enough buffers for a full queue plus the ones being encoded
+			if (bufferPool.size() < maxQueued + numThreads) {
+				bufferPool.push_back(std::move(job.pixels));
+			}
+			activeJobs--;
+		}
+		jobDone.notify_all();
+	}
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <stdint.h>
+
+// Saves PNG files on background threads so that rendering can continue while images are
+// compressed. The queue is bounded, so submit() blocks while it's full instead of letting
+// rendered frames pile up in memory. Pixel buffers are recycled between images.
+class PngEncodeQueue
+{
+public:
+	// numThreads 0 = one thread per CPU core. maxQueued 0 = twice the thread count.
+	PngEncodeQueue(int numThreads = 0, int maxQueued = 0);
+	~PngEncodeQueue(); // waits for queued images to be saved
+
+	// get a buffer with room for the given number of bytes, from the pool if possible
+	std::vector<uint8_t> acquire(size_t bytes);
+
+	// queue RGBA pixels (top row first) to be saved. onSaved is called from an encoder thread
+	// after the file is written, with false if encoding or writing failed.
+	void submit(std::string path, int width, int height, std::vector<uint8_t>&& pixels,
+		std::function<void(bool)> onSaved = nullptr);
+
+	// wait for every queued image to be saved
+	void finish();
+
+	int getThreadCount() { return numThreads; }
+	int getMaxQueued() { return maxQueued; }
+	int getPeakDepth() { return peakDepth; } // most images that were waiting at once
+
+private:
+	struct Job {
+		std::string path;
+		int width;
+		int height;
+		std::vector<uint8_t> pixels;
+		std::function<void(bool)> onSaved;
+	};
+
+	int numThreads;
+	int maxQueued;
+	int peakDepth = 0;
+	int activeJobs = 0; // jobs being encoded
+	bool stopping = false;
+
+	std::deque<Job> queue;
+	std::vector<std::vector<uint8_t>> bufferPool;
+	std::vector<std::thread> workers;
+	std::mutex queueLock;
+	std::condition_variable jobAdded; // signals workers
+	std::condition_variable jobDone; // signals submit() and finish()
+
+	void workerLoop();
+};
@@ -5,7 +5,12 @@
 #include "MdlRenderer.h"
 #include "primitives.h"
 #include "lodepng.h"
+#include "SoftRasterizer.h"
+#include "ApngEncoder.h"
+#include "PngEncodeQueue.h"
+#include "base_resample.h"
 #include <cfloat>
+#include <mutex>
 
 #ifndef EMSCRIPTEN
 #include <GL/glew.h>
@@ -18,8 +23,6 @@
 #include <GL/osmesa.h>
 #endif
 
-Renderer* g_app;
-
 int glGetErrorDebug() {
 	return glGetError();
 }
@@ -42,15 +45,39 @@ void error_callback(int error, const char* description)
 }
 
 void file_drop_callback(GLFWwindow* window, int count, const char** paths) {
-	g_app->load_model(paths[0]);
+	Renderer* app = (Renderer*)glfwGetWindowUserPointer(window);
+	app->load_model_async(paths[0]);
 }
 
-Renderer::Renderer(string fpath, int width, int height, bool legacy_renderer, bool headless) {
+Renderer::Renderer(string fpath, int width, int height, bool legacy_renderer, bool headless, bool software) {
 	this->legacy_renderer = legacy_renderer;
 	this->headless = headless;
 	this->windowWidth = width;
 	this->windowHeight = height;
-	g_app = this;
+
+#ifdef EMSCRIPTEN
+	model_cache_bytes = 32 * 1024 * 1024; // the whole heap is only 128 MB
+#else
+	model_cache_bytes = 256 * 1024 * 1024;
+#endif
+	if (headless) {
+		model_cache_bytes = 0; // images and thumbnail batches never show a model twice
+	}
+
+	// images are rendered from a fixed angle and frame
+	rotate_speed = headless ? 0 : 50;
+	fixed_clock = headless;
+
+	if (software) {
+		// Models are drawn with CPU skinning, like the legacy renderer. No GL calls are made.
+		this->legacy_renderer = true;
+		softRasterizer = new SoftRasterizer(width, height);
+		valid = true;
+
+		if (fpath.size())
+			load_model(fpath);
+		return;
+	}
 
 	if (headless) {
 #if defined(WIN32) || defined(EMSCRIPTEN)
@@ -64,14 +91,128 @@ Renderer::Renderer(string fpath, int width, int height, bool legacy_renderer, bo
 
 	if (valid) {
 		init_gl();
-		mdlShader->bind();
+		mdlShaders->get(0)->bind();
 		if (fpath.size())
 			load_model(fpath);
 	}
 }
 
+Renderer::~Renderer() {
+	// worker threads must finish before their models are deleted. Deferred loads never started.
+	if (loadingRenderer) {
+		if (loadingTask.wait_for(std::chrono::seconds(0)) != std::future_status::deferred) {
+			loadingTask.wait();
+		}
+		delete loadingRenderer;
+	}
+	for (auto it = abandonedLoads.begin(); it != abandonedLoads.end(); it++) {
+		it->task.wait();
+		delete it->renderer;
+	}
+	abandonedLoads.clear();
+
+	for (auto it = modelCache.begin(); it != modelCache.end(); it++) {
+		delete *it;
+	}
+	modelCache.clear();
+
+	// models and shaders delete GL objects, so the context is destroyed last
+	delete mdlRenderer;
+	delete softRasterizer;
+	delete mdlShaders;
+	delete mdlWireShader;
+	delete colorShader;
+
+#if defined(WIN32) || defined(EMSCRIPTEN)
+	if (window) {
+		glfwDestroyWindow(window);
+	}
+#else
+	if (mesa3d_context) {
+		OSMesaDestroyContext((OSMesaContext)mesa3d_context);
+	}
+	free(mesa3d_buffer);
+#endif
+}
+
 bool Renderer::load_model(std::string fpath) {
-	MdlRenderer* newRenderer = new MdlRenderer(mdlShader, mdlWireShader, legacy_renderer, fpath);
+	MdlRenderer* newRenderer = new MdlRenderer(mdlShaders, mdlWireShader, legacy_renderer, paletted_textures, fpath);
+	newRenderer->loadData();
+
+	return finish_model_load(newRenderer);
+}
+
+void Renderer::load_model_async(std::string fpath, const std::vector<MdlFileBuffer>& files, std::string hash) {
+	if (loadingRenderer) {
+		// The new model replaces the old one. A deferred load hasn't started yet, so it can be
+		// deleted now. A threaded load can't be canceled, so it's deleted when it finishes.
+		if (loadingTask.wait_for(std::chrono::seconds(0)) == std::future_status::deferred) {
+			delete loadingRenderer;
+		}
+		else {
+			abandonedLoads.push_back({ loadingRenderer, std::move(loadingTask) });
+		}
+		loadingRenderer = NULL;
+	}
+
+	// constructed here because it looks up shader variants, which isn't thread-safe
+	loadingRenderer = new MdlRenderer(mdlShaders, mdlWireShader, legacy_renderer, paletted_textures, fpath);
+	for (int i = 0; i < files.size(); i++) {
+		loadingRenderer->addFileBuffer(files[i]);
+	}
+
+#if defined(EMSCRIPTEN) && !defined(__EMSCRIPTEN_PTHREADS__)
+	// no threads in this build. Load on the main thread when the result is checked.
+	std::launch policy = std::launch::deferred;
+#else
+	std::launch policy = std::launch::async;
+#endif
+
+	loadingTask = std::async(policy, &MdlRenderer::loadData, loadingRenderer);
+	loadingCanceled = false;
+	loadingHash = hash;
+}
+
+int Renderer::update_model_load() {
+	for (auto it = abandonedLoads.begin(); it != abandonedLoads.end();) {
+		if (it->task.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+			delete it->renderer;
+			it = abandonedLoads.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+
+	if (!loadingRenderer) {
+		return MODEL_LOAD_NONE;
+	}
+
+	if (loadingTask.wait_for(std::chrono::seconds(0)) == std::future_status::timeout) {
+		return MODEL_LOAD_PENDING;
+	}
+
+	loadingTask.get();
+	MdlRenderer* newRenderer = loadingRenderer;
+	loadingRenderer = NULL;
+
+	if (loadingCanceled) {
+		delete newRenderer;
+		return MODEL_LOAD_NONE;
+	}
+
+	if (newRenderer->valid && loadingHash.size() && newRenderer->getHash() != loadingHash) {
+		printf("Model %s has hash %s but %s was expected\n", newRenderer->getPath().c_str(),
+			newRenderer->getHash().c_str(), loadingHash.c_str());
+		delete newRenderer;
+		return MODEL_LOAD_MISMATCH;
+	}
+
+	return finish_model_load(newRenderer) ? MODEL_LOAD_DONE : MODEL_LOAD_FAILED;
+}
+
+bool Renderer::finish_model_load(MdlRenderer* newRenderer) {
+	string fpath = newRenderer->getPath();
 
 	if (!newRenderer->valid) {
 		printf("Failed to load model: %s\n", fpath.c_str());
@@ -79,24 +220,76 @@ bool Renderer::load_model(std::string fpath) {
 		return false;
 	}
 
-	this->fpath = fpath;
+	newRenderer->upload();
+
+	printf("Loaded %s (%.1f KB resident, %.1f KB GPU)\n", fpath.c_str(),
+		newRenderer->getResidentBytes() / 1024.0f, newRenderer->getGpuBytes() / 1024.0f);
+
+	set_model(newRenderer);
 
+	return true;
+}
+
+void Renderer::set_model(MdlRenderer* newRenderer) {
 	if (mdlRenderer) {
-		delete mdlRenderer;
+		modelCache.push_front(mdlRenderer);
 	}
 
 	mdlRenderer = newRenderer;
+	fpath = newRenderer->getPath();
 	renderOpts.sequence = 0;
 	reset_view();
 
-	return true;
+	trim_model_cache();
+}
+
+bool Renderer::use_cached_model(std::string fpath, std::string hash) {
+	for (auto it = modelCache.begin(); it != modelCache.end(); it++) {
+		MdlRenderer* cached = *it;
+
+		if (cached->getPath() == fpath && (hash.empty() || cached->getHash() == hash)) {
+			if (loadingRenderer) {
+				loadingCanceled = true; // don't replace this model when the other one is loaded
+			}
+
+			modelCache.erase(it);
+			set_model(cached);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Renderer::trim_model_cache() {
+	size_t totalBytes = 0;
+
+	// keep the most recently used models that fit in the budget, and everything older goes
+	auto it = modelCache.begin();
+	for (; it != modelCache.end(); it++) {
+		MdlRenderer* cached = *it;
+		totalBytes += cached->getResidentBytes() + cached->getGpuBytes();
+
+		if (totalBytes > model_cache_bytes) {
+			break;
+		}
+	}
+
+	while (it != modelCache.end()) {
+		delete *it;
+		it = modelCache.erase(it);
+	}
 }
 
 void Renderer::unload_model() {
 	if (mdlRenderer) {
-		delete mdlRenderer;
+		// keep it around in case it's shown again
+		modelCache.push_front(mdlRenderer);
 		mdlRenderer = NULL;
+		fitModel = NULL;
+		trim_model_cache();
 	}
+	request_redraw();
 }
 
 void Renderer::change_animation(int idx) {
@@ -107,6 +300,8 @@ void Renderer::change_animation(int idx) {
 void Renderer::reset_view() {
 	modelOrigin = vec3();
 	modelAngles = vec3(0, -90, 0);
+	fitModel = NULL; // the cached model may have been deleted
+	request_redraw();
 
 	if (mdlRenderer) {
 		mdlRenderer->drawFrame = 0;
@@ -158,6 +353,7 @@ bool Renderer::create_window(int width, int height) {
 	}
 
 	glfwSetErrorCallback(error_callback);
+	glfwSetWindowUserPointer(window, this);
 	glfwSetDropCallback(window, file_drop_callback);
 
 	glfwSetWindowSizeLimits(window, 250, 50, GLFW_DONT_CARE, GLFW_DONT_CARE);
@@ -175,34 +371,8 @@ bool Renderer::create_window(int width, int height) {
 	return true;
 }
 
-bool Renderer::create_headless_context(int width, int height) {
 #if !defined(WIN32) && !defined(EMSCRIPTEN)
-	const int attribs[] = {
-		OSMESA_FORMAT, OSMESA_RGBA,
-		OSMESA_DEPTH_BITS, 16,
-		OSMESA_PROFILE, OSMESA_COMPAT_PROFILE,
-		0
-	};
-	OSMesaContext ctx = OSMesaCreateContextAttribs(attribs, NULL);
-
-	if (!ctx) {
-		printf("OSMesaCreateContext failed!\n");
-		return false;
-	}
-
-	/* Allocate the image buffer */
-	mesa3d_buffer = (unsigned char*)aligned_alloc(16, width * height * 4);
-	if (!mesa3d_buffer) {
-		printf("Alloc image buffer failed!\n");
-		return false;
-	}
-
-	/* Bind the buffer to the context and make it current */
-	if (!OSMesaMakeCurrent(ctx, mesa3d_buffer, GL_UNSIGNED_BYTE, width, height)) {
-		printf("OSMesaMakeCurrent failed!\n");
-		return false;
-	}
-
+static void load_osmesa_functions() {
 	//GLenum err = glewInit();
 	//if (err != GLEW_OK) {
 		//printf("Failed to initialize GLEW: %s\n", glewGetErrorString(err));
@@ -235,6 +405,7 @@ bool Renderer::create_headless_context(int width, int height) {
 	glUniformMatrix4fv = (PFNGLUNIFORMMATRIX4FVPROC)OSMesaGetProcAddress("glUniformMatrix4fv");
 	glGetUniformLocation = (PFNGLGETUNIFORMLOCATIONPROC)OSMesaGetProcAddress("glGetUniformLocation");
 	glGetAttribLocation = (PFNGLGETATTRIBLOCATIONPROC)OSMesaGetProcAddress("glGetAttribLocation");
+	glBindAttribLocation = (PFNGLBINDATTRIBLOCATIONPROC)OSMesaGetProcAddress("glBindAttribLocation");
 	glGetProgramiv = (PFNGLGETPROGRAMIVPROC)OSMesaGetProcAddress("glGetProgramiv");
 	glGetProgramInfoLog = (PFNGLGETPROGRAMINFOLOGPROC)OSMesaGetProcAddress("glGetProgramInfoLog");
 	glGenVertexArrays = (PFNGLGENVERTEXARRAYSPROC)OSMesaGetProcAddress("glGenVertexArrays");
@@ -248,6 +419,41 @@ bool Renderer::create_headless_context(int width, int height) {
 	glDisableVertexAttribArray = (PFNGLDISABLEVERTEXATTRIBARRAYPROC)OSMesaGetProcAddress("glDisableVertexAttribArray");
 	glVertexAttribPointer = (PFNGLVERTEXATTRIBPOINTERPROC)OSMesaGetProcAddress("glVertexAttribPointer");
 	glActiveTexture = (PFNGLACTIVETEXTUREPROC)OSMesaGetProcAddress("glActiveTexture");
+}
+#endif
+
+bool Renderer::create_headless_context(int width, int height) {
+#if !defined(WIN32) && !defined(EMSCRIPTEN)
+	const int attribs[] = {
+		OSMESA_FORMAT, OSMESA_RGBA,
+		OSMESA_DEPTH_BITS, 16,
+		OSMESA_PROFILE, OSMESA_COMPAT_PROFILE,
+		0
+	};
+	OSMesaContext ctx = OSMesaCreateContextAttribs(attribs, NULL);
+
+	if (!ctx) {
+		printf("OSMesaCreateContext failed!\n");
+		return false;
+	}
+	mesa3d_context = ctx;
+
+	/* Allocate the image buffer */
+	mesa3d_buffer = (unsigned char*)aligned_alloc(16, width * height * 4);
+	if (!mesa3d_buffer) {
+		printf("Alloc image buffer failed!\n");
+		return false;
+	}
+
+	/* Bind the buffer to the context and make it current */
+	if (!OSMesaMakeCurrent(ctx, mesa3d_buffer, GL_UNSIGNED_BYTE, width, height)) {
+		printf("OSMesaMakeCurrent failed!\n");
+		return false;
+	}
+
+	// the entry points are process globals, shared by every context
+	static std::once_flag loadedFunctions;
+	std::call_once(loadedFunctions, load_osmesa_functions);
 #endif
 
 	return true;
@@ -264,24 +470,30 @@ void Renderer::compile_shaders() {
 	colorShader->setMatrixNames(NULL, "modelViewProjection");
 	colorShader->setVertexAttributeNames("vPosition", "vColor", NULL, NULL);
 
-	mdlShader = new ShaderProgram("MDL");
-	mdlShader->compile(mdl_vert, mdl_frag_glsl);
-	mdlShader->setMatrixes(&model, &view, &projection, &modelView, &modelViewProjection);
-	mdlShader->setMatrixNames(NULL, "modelViewProjection");
-	mdlShader->setVertexAttributeNames("vPosition", NULL, "vTex", "vNormal");
-	mdlShader->addUniform("sTex", UNIFORM_INT);
-	mdlShader->addUniform("elights", UNIFORM_INT);
-	mdlShader->addUniform("ambient", UNIFORM_VEC3);
-	mdlShader->addUniform("lights", UNIFORM_MAT3);
-	mdlShader->addUniform("additiveEnable", UNIFORM_INT);
-	mdlShader->addUniform("chromeEnable", UNIFORM_INT);
-	mdlShader->addUniform("flatshadeEnable", UNIFORM_INT);
-	mdlShader->addUniform("colorMult", UNIFORM_VEC4);
-	if (!legacy_renderer) {
-		mdlShader->addUniform("viewerOrigin", UNIFORM_VEC3);
-		mdlShader->addUniform("viewerRight", UNIFORM_VEC3);
-		mdlShader->addUniform("boneMatrixTexture", UNIFORM_INT);
-	}
+	// names must match the order of the MDL_SHADER_* flags
+	mdlShaders = new ShaderVariants("MDL", mdl_vert, mdl_frag_glsl, { "CHROME", "ADDITIVE", "FLATSHADE", "FULLBRIGHT", "MASKED", "PALETTED", "REMAP" });
+	mdlShaders->attributeLocations = { "vPosition", "vNormal", "vTex", "vBone" };
+	mdlShaders->setup = [this](ShaderProgram* shader) {
+		// uniforms are optional because some variants don't use lighting or chrome
+		shader->setMatrixes(&model, &view, &projection, &modelView, &modelViewProjection);
+		shader->setMatrixNames(NULL, "modelViewProjection");
+		shader->setVertexAttributeNames("vPosition", NULL, "vTex", "vNormal");
+		shader->addUniform("sTex", UNIFORM_INT);
+		shader->addUniform("sPalette", UNIFORM_INT, true);
+		shader->addUniform("texSize", UNIFORM_VEC2, true);
+		shader->addUniform("uvScale", UNIFORM_VEC2, true);
+		shader->addUniform("elights", UNIFORM_INT, true);
+		shader->addUniform("ambient", UNIFORM_VEC3, true);
+		shader->addUniform("lights", UNIFORM_MAT3, true);
+		shader->addUniform("colorMult", UNIFORM_VEC4);
+		shader->addUniform("remapRanges", UNIFORM_VEC4, true);
+		shader->addUniform("remapHues", UNIFORM_VEC2, true);
+		if (!legacy_renderer) {
+			shader->addUniform("viewerOrigin", UNIFORM_VEC3, true);
+			shader->addUniform("viewerRight", UNIFORM_VEC3, true);
+			shader->addUniform("boneMatrixTexture", UNIFORM_INT);
+		}
+	};
 
 	mdlWireShader = new ShaderProgram("MDL_wire");
 	mdlWireShader->compile(mdl_wire_vert, mdl_wire_frag_glsl);
@@ -329,13 +541,15 @@ void Renderer::drawBoxOutline(vec3 center, vec3 mins, vec3 maxs, COLOR4 color) {
 	buffer.draw(GL_LINES);
 }
 
-void Renderer::get_model_fit_offsets(vec3 modelOrigin, vec3 modelAngles, float& depthOffset, float& heightOffset) {
-	vec3 mins(FLT_MAX, FLT_MAX, FLT_MAX);
-	vec3 maxs(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+void Renderer::get_model_fit_bounds(vec3 modelAngles, vec3& mins, vec3& maxs) {
+	mins = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	maxs = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
 	mdlRenderer->getModelBoundingBox(modelAngles, renderOpts.sequence, mins, maxs);
 	mins = mins.flip();
 	maxs = maxs.flip();
+}
 
+void Renderer::get_model_fit_offsets(vec3 mins, vec3 maxs, float& depthOffset, float& heightOffset) {
 	float targetWidth = max(fabs(maxs.x), fabs(mins.x)) * 2;
 	float targetHeight = maxs.y - mins.y;
 
@@ -346,39 +560,57 @@ void Renderer::get_model_fit_offsets(vec3 modelOrigin, vec3 modelAngles, float&
 
 	float aspect = (float)windowWidth / (float)windowHeight;
 	float tanHalfFov = tan(fov * (PI / 180.0f) * 0.5f);
-	float i_width = targetWidth / (2.0f * aspect * tanHalfFov);
-	float i_height = targetHeight / (2.0f * tanHalfFov);
+	float i_width = targetWidth / (2.0f * aspect * tanHalfFov * fitScale.x);
+	float i_height = targetHeight / (2.0f * tanHalfFov * fitScale.y);
 
 	depthOffset = mins.z + max(i_width, i_height);
 	heightOffset = -(mins.y + (maxs.y - mins.y)*0.5f);
 }
 
 void Renderer::setup_render() {
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
-	glActiveTexture(GL_TEXTURE0);
+	if (softRasterizer) {
+		softRasterizer->cullBackFaces = headless;
+	}
+	else {
+		glEnable(GL_DEPTH_TEST);
+		glEnable(GL_CULL_FACE);
+		glActiveTexture(GL_TEXTURE0);
+		glCullFace(headless ? GL_BACK : GL_FRONT);
+	}
 
 	memset(&renderOpts, 0, sizeof(EntRenderOpts));
 	renderOpts.scale = 1.0f;
 	renderOpts.framerate = 1.0f;
 	renderOpts.rendercolor = COLOR3(255, 255, 255);
 	renderOpts.body = 255; // default to "cl_himodels = 1" body
-
-	glCullFace(headless ? GL_BACK : GL_FRONT);
+	renderOpts.topcolor = -1;
+	renderOpts.bottomcolor = -1;
 }
 
 void Renderer::render() {
 #if defined(WIN32) || defined(EMSCRIPTEN)
-	glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
+	if (!softRasterizer)
+		glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
 #endif
 
-	glViewport(0, 0, windowWidth, windowHeight);
+	redrawRequested = false;
+	lastRenderTime = getEpochMillis();
+	lastRenderWidth = windowWidth;
+	lastRenderHeight = windowHeight;
+	memcpy(&lastRenderOpts, &renderOpts, sizeof(EntRenderOpts));
+
 	projection.perspective(fov, (float)windowWidth / (float)windowHeight, zNear, zFar);
 	view.loadIdentity();
 	model.loadIdentity();
 
-	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if (softRasterizer) {
+		softRasterizer->clear();
+	}
+	else {
+		glViewport(0, 0, windowWidth, windowHeight);
+		glClearColor(0, 0, 0, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
 
 	if (!mdlRenderer)
 		return;
@@ -386,17 +618,15 @@ void Renderer::render() {
 	if (headless)
 		projection(5) *= -1;
 
-	static uint64_t lastFrame = 0;
-
 	uint64_t now = getEpochMillis();
-	float dt = TimeDifference(lastFrame, now);
-	lastFrame = now;
+	float dt = fixed_clock ? 0 : TimeDifference(lastFrameTime, now);
+	lastFrameTime = now;
 
 	if (dt > 0.5f) {
 		dt = 0;
 	}
 
-	modelAngles.y = normalizeRangef(modelAngles.y + dt*50, 0, 360);
+	modelAngles.y = normalizeRangef(modelAngles.y + dt*rotate_speed, 0, 360);
 	//modelAngles.x = normalizeRangef(modelAngles.x + 0.5f, 0, 360);
 	/*
 	if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
@@ -413,10 +643,109 @@ void Renderer::render() {
 	}
 	*/
 
-	float depthOffset;
-	get_model_fit_offsets(modelOrigin, modelAngles, depthOffset, modelOrigin.z);
-	modelOrigin.y = max(modelOrigin.y, depthOffset);
-	mdlRenderer->draw(modelOrigin, modelAngles, renderOpts, cameraOrigin, cameraRight);
+	update_model_fit();
+	modelOrigin.y = max(modelOrigin.y, fitDepthOffset);
+	modelOrigin.z = fitHeightOffset;
+	mdlRenderer->realtime = !fixed_clock;
+
+	if (softRasterizer) {
+		mdlRenderer->drawSoftware(softRasterizer, projection * view, modelOrigin, modelAngles, renderOpts, cameraOrigin, cameraRight);
+		softRasterizer->finish();
+	}
+	else {
+		mdlRenderer->draw(modelOrigin, modelAngles, renderOpts, cameraOrigin, cameraRight);
+	}
+}
+
+void Renderer::update_model_fit() {
+	// a turntable fit covers every yaw, so it only changes with the sequence
+	bool anyYaw = rotate_speed != 0 || fitAllYaws;
+	bool angleChanged = !anyYaw && (fitAngles.x != modelAngles.x || fitAngles.y != modelAngles.y || fitAngles.z != modelAngles.z);
+
+	if (fitModel == mdlRenderer && fitSequence == renderOpts.sequence && fitWidth == windowWidth
+		&& fitHeight == windowHeight && !angleChanged) {
+		return;
+	}
+
+	if (anyYaw) {
+		// The vertical extent changes with yaw if the model is pitched or rolled, so every
+		// sample is fit with the combined vertical extent of all of them.
+		const int numSamples = 24;
+		vec3 mins[numSamples];
+		vec3 maxs[numSamples];
+		float minY = FLT_MAX;
+		float maxY = -FLT_MAX;
+
+		for (int i = 0; i < numSamples; i++) {
+			vec3 angles = vec3(modelAngles.x, i * (360.0f / numSamples), modelAngles.z);
+			get_model_fit_bounds(angles, mins[i], maxs[i]);
+			minY = min(minY, mins[i].y);
+			maxY = max(maxY, maxs[i].y);
+		}
+
+		fitDepthOffset = -FLT_MAX;
+		for (int i = 0; i < numSamples; i++) {
+			mins[i].y = minY;
+			maxs[i].y = maxY;
+			float depthOffset;
+			get_model_fit_offsets(mins[i], maxs[i], depthOffset, fitHeightOffset);
+			fitDepthOffset = max(fitDepthOffset, depthOffset);
+		}
+	}
+	else {
+		vec3 mins, maxs;
+		get_model_fit_bounds(modelAngles, mins, maxs);
+		get_model_fit_offsets(mins, maxs, fitDepthOffset, fitHeightOffset);
+	}
+
+	fitModel = mdlRenderer;
+	fitSequence = renderOpts.sequence;
+	fitWidth = windowWidth;
+	fitHeight = windowHeight;
+	fitAngles = modelAngles;
+}
+
+float Renderer::get_frame_interval() {
+	if (!mdlRenderer) {
+		return -1;
+	}
+
+	float fps = mdlRenderer->getSequenceFps(renderOpts.sequence);
+	if (rotate_speed != 0) {
+		fps = max(fps, min_rotate_fps);
+	}
+
+	return fps > 0 ? 1.0f / fps : -1;
+}
+
+bool Renderer::needs_redraw() {
+	if (redrawRequested || renderOpts != lastRenderOpts) {
+		return true;
+	}
+
+#if defined(WIN32) || defined(EMSCRIPTEN)
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	if (width != lastRenderWidth || height != lastRenderHeight) {
+		return true;
+	}
+#endif
+
+	return time_until_redraw() == 0;
+}
+
+float Renderer::time_until_redraw() {
+	if (redrawRequested) {
+		return 0;
+	}
+
+	float interval = get_frame_interval();
+	if (interval < 0) {
+		return -1;
+	}
+
+	float elapsed = TimeDifference(lastRenderTime, getEpochMillis());
+	return max(0.0f, interval - elapsed);
 }
 
 void Renderer::render_loop() {
@@ -429,31 +758,318 @@ void Renderer::render_loop() {
 	setup_render();
 
 	while (!glfwWindowShouldClose(window)) {
-		glfwPollEvents();
+		update_model_load();
+
+		bool minimized = glfwGetWindowAttrib(window, GLFW_ICONIFIED);
+		if (!minimized && needs_redraw()) {
+			render();
+			glfwSwapBuffers(window);
+			glCheckError("Swap buffers and controls");
+		}
+
+		// sleep until the next frame is due or the user does something
+		float timeout = minimized ? -1 : time_until_redraw();
+		if (loadingRenderer || !abandonedLoads.empty()) {
+			timeout = timeout < 0 ? 0.05f : min(timeout, 0.05f); // poll the background loads
+		}
+
+		if (timeout < 0) {
+			glfwWaitEvents();
+		}
+		else if (timeout > 0) {
+			glfwWaitEventsTimeout(timeout);
+		}
+		else {
+			glfwPollEvents();
+		}
+	}
+#endif
+}
 
-		render();
+void Renderer::set_render_threads(int count) {
+	if (softRasterizer) {
+		softRasterizer->setThreadCount(count);
+	}
+}
 
-		glfwSwapBuffers(window);
-		glCheckError("Swap buffers and controls");
+void Renderer::apply_image_params(const ImageParams& params) {
+	renderOpts.sequence = params.sequence;
+	renderOpts.body = params.body;
+	renderOpts.skin = params.skin;
+	renderOpts.topcolor = params.topcolor;
+	renderOpts.bottomcolor = params.bottomcolor;
+
+	reset_view();
+	modelAngles = vec3(params.pitch, -90 + params.yaw, 0);
+
+	if (mdlRenderer) {
+		mdlRenderer->drawFrame = params.frame;
 	}
+}
+
+uint8_t* Renderer::get_pixels() {
+	if (softRasterizer) {
+		return softRasterizer->getPixels();
+	}
+
+	glFlush();
+#if defined(WIN32) || defined(EMSCRIPTEN)
+	readBuffer.resize(windowWidth * windowHeight * 4);
+	glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, &readBuffer[0]);
+	return &readBuffer[0];
+#else
+	return mesa3d_buffer; // rendered to directly, so no copy is needed
 #endif
 }
 
-void Renderer::create_image(string outPath) {
+void Renderer::read_pixels(uint8_t* dst, int dstWidth, int x, int y) {
+	uint8_t* src = get_pixels();
+
+	int rowBytes = windowWidth * 4;
+	for (int row = 0; row < windowHeight; row++) {
+		memcpy(dst + ((y + row) * dstWidth + x) * 4, src + row * rowBytes, rowBytes);
+	}
+}
+
+bool Renderer::create_image(string outPath, const ImageParams& params, std::function<void(bool)> onSaved) {
 	if (!valid) {
 		printf("Aborting render. Context creation failed.\n");
-		return;
+		return false;
+	}
+	if (!mdlRenderer) {
+		printf("Aborting render. No model loaded.\n");
+		return false;
+	}
+	setup_render();
+	apply_image_params(params);
+
+	int cols = max(1, params.gridAngles);
+	int rows = max(1, params.gridFrames);
+	int imageWidth = windowWidth * cols;
+	int imageHeight = windowHeight * rows;
+	size_t imageBytes = imageWidth * imageHeight * 4;
+	vector<uint8_t> pixels = encodeQueue ? encodeQueue->acquire(imageBytes) : vector<uint8_t>(imageBytes);
+
+	// Use the same fit for every cell so the model doesn't change size between angles.
+	// Bounds cover every frame of the sequence, so they're only calculated once.
+	fitAllYaws = cols > 1;
+
+	int numFrames = mdlRenderer->getSequenceFrames(renderOpts.sequence);
+	float frameStep = max(0, numFrames - 1) / (float)rows;
+
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < cols; x++) {
+			modelAngles.y = -90 + params.yaw + x * (360.0f / cols);
+			mdlRenderer->drawFrame = params.frame + y * frameStep;
+			if (numFrames > 1) {
+				mdlRenderer->drawFrame = normalizeRangef(mdlRenderer->drawFrame, 0.0f, numFrames - 1);
+			}
+
+			render();
+			read_pixels(&pixels[0], imageWidth, x * windowWidth, y * windowHeight);
+		}
+	}
+
+	fitAllYaws = false;
+
+	if (encodeQueue) {
+		// the next image can be rendered while this one is compressed
+		encodeQueue->submit(outPath, imageWidth, imageHeight, std::move(pixels), onSaved);
+		return true;
+	}
+
+	unsigned error = lodepng_encode32_file(outPath.c_str(), &pixels[0], imageWidth, imageHeight);
+	if (error) {
+		printf("Failed to write %s: %s\n", outPath.c_str(), lodepng_error_text(error));
+	}
+	if (onSaved) {
+		onSaved(error == 0);
+	}
+
+	return error == 0;
+}
+
+bool Renderer::create_images(const vector<ImageSize>& sizes, const ImageParams& params) {
+	if (!valid) {
+		printf("Aborting render. Context creation failed.\n");
+		return false;
 	}
+	if (!mdlRenderer) {
+		printf("Aborting render. No model loaded.\n");
+		return false;
+	}
+
+	// largest area of the view with the same aspect ratio as each image
+	vector<int> cropWidths(sizes.size());
+	vector<int> cropHeights(sizes.size());
+	fitScale = vec2(1, 1);
+
+	for (int i = 0; i < sizes.size(); i++) {
+		if (sizes[i].width * windowHeight >= sizes[i].height * windowWidth) {
+			cropWidths[i] = windowWidth;
+			cropHeights[i] = max(1, (int)roundf(windowWidth * sizes[i].height / (float)sizes[i].width));
+		}
+		else {
+			cropHeights[i] = windowHeight;
+			cropWidths[i] = max(1, (int)roundf(windowHeight * sizes[i].width / (float)sizes[i].height));
+		}
+
+		fitScale.x = min(fitScale.x, cropWidths[i] / (float)windowWidth);
+		fitScale.y = min(fitScale.y, cropHeights[i] / (float)windowHeight);
+	}
+
 	setup_render();
+	apply_image_params(params);
 	render();
-	glFlush();
+	fitScale = vec2(1, 1);
+
+	uint8_t* pixels = get_pixels();
+	bool success = true;
+
+	for (int i = 0; i < sizes.size(); i++) {
+		const ImageSize& size = sizes[i];
+		int cropWidth = cropWidths[i];
+		int cropHeight = cropHeights[i];
+		int cropX = (windowWidth - cropWidth) / 2;
+		int cropY = (windowHeight - cropHeight) / 2;
+
+		vector<uint8_t> crop(cropWidth * cropHeight * 4);
+		for (int y = 0; y < cropHeight; y++) {
+			memcpy(&crop[y * cropWidth * 4], pixels + ((cropY + y) * windowWidth + cropX) * 4, cropWidth * 4);
+		}
+
+		vector<uint8_t> resized;
+		uint8_t* image = &crop[0];
+		if (cropWidth != size.width || cropHeight != size.height) {
+			resized.resize(size.width * size.height * 4);
+			base::ResampleImage32(&crop[0], cropWidth, cropHeight, &resized[0], size.width, size.height,
+				base::KernelType::KernelTypeAverage);
+			image = &resized[0];
+		}
+
+		unsigned error = lodepng_encode32_file(size.path.c_str(), image, size.width, size.height);
+		if (error) {
+			printf("Failed to write %s: %s\n", size.path.c_str(), lodepng_error_text(error));
+			success = false;
+		}
+	}
 
-#if defined(WIN32) || defined(EMSCRIPTEN)
-	uint8_t* pixels = new uint8_t[windowWidth * windowHeight * 4];
-	glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
-	lodepng_encode32_file(outPath.c_str(), pixels, windowWidth, windowHeight);
-	delete[] pixels;
-#else
-	lodepng_encode32_file(outPath.c_str(), mesa3d_buffer, windowWidth, windowHeight);
-#endif
+	return success;
+}
+
+int Renderer::get_loop_frame_count(float fps) {
+	// one loop of the sequence, or a single frame if it doesn't animate
+	int seqFrames = mdlRenderer->getSequenceFrames(renderOpts.sequence);
+	float seqFps = mdlRenderer->getSequenceFps(renderOpts.sequence);
+	if (seqFps <= 0) {
+		return 1;
+	}
+
+	return max(1, (int)roundf(((seqFrames - 1) / seqFps) * fps));
+}
+
+float Renderer::get_loop_frame(const ImageParams& params, int idx, float fps) {
+	int seqFrames = mdlRenderer->getSequenceFrames(renderOpts.sequence);
+	float seqFps = mdlRenderer->getSequenceFps(renderOpts.sequence);
+	if (seqFrames <= 1) {
+		return 0;
+	}
+
+	return normalizeRangef(params.frame + (idx / fps) * seqFps, 0.0f, seqFrames - 1);
+}
+
+// convert RGBA to full-resolution BT.601 (limited range) Y, U, and V planes
+static void write_y4m_frame(FILE* out, uint8_t* pixels, int width, int height, vector<uint8_t>& planes) {
+	int numPixels = width * height;
+	planes.resize(numPixels * 3);
+	uint8_t* py = &planes[0];
+	uint8_t* pu = py + numPixels;
+	uint8_t* pv = pu + numPixels;
+
+	for (int i = 0; i < numPixels; i++) {
+		int r = pixels[i * 4 + 0];
+		int g = pixels[i * 4 + 1];
+		int b = pixels[i * 4 + 2];
+		py[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+		pu[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+		pv[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+
+	fputs("FRAME\n", out);
+	fwrite(&planes[0], 1, planes.size(), out);
+}
+
+bool Renderer::stream_frames(FILE* out, float fps, bool y4m, const ImageParams& params) {
+	if (!valid) {
+		printf("Aborting render. Context creation failed.\n");
+		return false;
+	}
+	if (!mdlRenderer) {
+		printf("Aborting render. No model loaded.\n");
+		return false;
+	}
+	if (fps <= 0) {
+		printf("Invalid frame rate: %f\n", fps);
+		return false;
+	}
+
+	setup_render();
+	apply_image_params(params);
+	int numFrames = get_loop_frame_count(fps);
+
+	if (y4m) {
+		fprintf(out, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C444\n", windowWidth, windowHeight, (int)roundf(fps * 1000));
+	}
+
+	vector<uint8_t> planes;
+	for (int i = 0; i < numFrames; i++) {
+		mdlRenderer->drawFrame = get_loop_frame(params, i, fps);
+		render();
+
+		uint8_t* pixels = get_pixels();
+		if (y4m) {
+			write_y4m_frame(out, pixels, windowWidth, windowHeight, planes);
+		}
+		else {
+			fwrite(pixels, 1, windowWidth * windowHeight * 4, out);
+		}
+
+		if (ferror(out)) {
+			printf("Failed to write frame %d\n", i);
+			return false;
+		}
+	}
+
+	fflush(out);
+	return true;
+}
+
+bool Renderer::create_animation(string outPath, float fps, const ImageParams& params) {
+	if (!valid) {
+		printf("Aborting render. Context creation failed.\n");
+		return false;
+	}
+	if (!mdlRenderer) {
+		printf("Aborting render. No model loaded.\n");
+		return false;
+	}
+	if (fps <= 0) {
+		printf("Invalid frame rate: %f\n", fps);
+		return false;
+	}
+
+	setup_render();
+	apply_image_params(params);
+	int numFrames = get_loop_frame_count(fps);
+
+	// frames are compressed on other threads while the next one renders
+	ApngEncoder encoder(windowWidth, windowHeight, fps);
+
+	for (int i = 0; i < numFrames; i++) {
+		mdlRenderer->drawFrame = get_loop_frame(params, i, fps);
+		render();
+		encoder.addFrame(get_pixels());
+	}
+
+	return encoder.save(outPath);
 }
@@ -1,21 +1,89 @@
+#pragma once
 #include "ShaderProgram.h"
+#include "ShaderVariants.h"
 #include "colors.h"
 #include "MdlRenderer.h"
+#include <list>
+#include <functional>
 
 class Model;
 class GLFWwindow;
+class SoftRasterizer;
+
+// increase when a change to the renderer affects the pixels of saved images (invalidates ImageCache)
+#define IMAGE_RENDER_VERSION 1
+
+// Model view and animation for headless images. Images are a pure function of the model and these.
+struct ImageParams {
+	int sequence = 0;
+	float frame = 0; // frame index in the sequence (fractions blend between frames)
+	float yaw = 0; // degrees, relative to the default front view
+	float pitch = 0;
+	int body = 255; // default to "cl_himodels = 1" body
+	int skin = 0;
+	int topcolor = -1; // hue (0-255) for remappable textures, or -1 to keep the original colors
+	int bottomcolor = -1;
+
+	// render a sprite sheet instead of a single view. Columns rotate the model evenly around
+	// 360 degrees, starting at yaw. Rows step evenly through the sequence, starting at frame.
+	// The image size is per cell.
+	int gridAngles = 1;
+	int gridFrames = 1;
+};
+
+struct ImageSize {
+	int width;
+	int height;
+	string path;
+};
+
+enum model_load_status {
+	MODEL_LOAD_NONE, // no model is loading
+	MODEL_LOAD_PENDING, // still loading on a worker thread
+	MODEL_LOAD_DONE, // the new model replaced the old one
+	MODEL_LOAD_FAILED,
+	MODEL_LOAD_MISMATCH, // the model file didn't have the expected hash, and was discarded
+};
+
+class PngEncodeQueue;
 
 class Renderer {
 public:
 	MdlRenderer* mdlRenderer = NULL;
 	EntRenderOpts renderOpts;
-
-	Renderer(std::string fpath, int width, int height, bool legacy_renderer, bool headless);
+	bool paletted_textures = true; // upload model textures as color indexes + palettes (applies to the next loaded model)
+	size_t model_cache_bytes; // memory budget for recently used models that aren't displayed (CPU + GPU)
+	float rotate_speed; // turntable speed in degrees per second (0 = static view)
+	float min_rotate_fps = 30; // redraw rate while rotating a model that doesn't animate
+	bool fixed_clock; // don't animate or rotate with real time (on for headless renderers)
+	PngEncodeQueue* encodeQueue = NULL; // save images from create_image on background threads
+
+	// software = draw headless images with the CPU rasterizer instead of creating a GL context.
+	// A renderer must be used on the thread that created it. Headless renderers can be created
+	// on any number of threads, each with its own context.
+	Renderer(std::string fpath, int width, int height, bool legacy_renderer, bool headless, bool software = false);
+	~Renderer(); // must be called on the thread that created the renderer, like everything else
+
+	Renderer(const Renderer&) = delete;
+	Renderer& operator=(const Renderer&) = delete;
 
 	bool load_model(std::string modl);
 
+	// Load a model on a worker thread. The current model is drawn until the new one is ready.
+	// Call update_model_load() every frame to finish loading it. files = model files that are
+	// already in memory (see MdlRenderer::addFileBuffer). Other files are read from disk.
+	// hash = expected md5 of the model file, or empty to accept any file.
+	void load_model_async(std::string fpath, const std::vector<MdlFileBuffer>& files = {}, std::string hash = "");
+
+	// replace the current model if a background load finished. Returns a MODEL_LOAD_* status.
+	int update_model_load();
+
 	void unload_model();
 
+	// Switch to a recently used model without loading it again. An empty hash matches any version
+	// of the file. Returns false if the model isn't cached.
+	bool use_cached_model(std::string fpath, std::string hash);
+
 	void change_animation(int idx);
 
 	void reset_view();
@@ -24,22 +92,84 @@ public:
 
 	void render_loop();
 
-	void create_image(string outPath);
+	// onSaved is called with the result after the file is written. Returns false on failure,
+	// or if the image couldn't be queued when using an encodeQueue.
+	bool create_image(string outPath, const ImageParams& params = ImageParams(),
+		std::function<void(bool)> onSaved = nullptr);
+
+	// render a single frame at the window size and save a downsampled copy for each size.
+	// Sizes with a different aspect ratio than the window are cropped from the center, and the
+	// model is fit inside the smallest crop so that it's fully visible in every image.
+	bool create_images(const vector<ImageSize>& sizes, const ImageParams& params = ImageParams());
+
+	// write one loop of the sequence as uncompressed frames, for piping into a video encoder.
+	// y4m = YUV4MPEG2 stream (4:4:4, alpha dropped), otherwise raw RGBA rows top to bottom.
+	bool stream_frames(FILE* out, float fps, bool y4m, const ImageParams& params = ImageParams());
+
+	// save one loop of the sequence as an animated PNG
+	bool create_animation(string outPath, float fps, const ImageParams& params = ImageParams());
+
+	// threads used by the software rasterizer (0 = one per CPU core)
+	void set_render_threads(int count);
 
 	void setup_render();
 
 	void render();
 
+	// true if the view changed or the next animation frame is due. The viewer skips
+	// rendering otherwise, so that a static model doesn't redraw at the display rate.
+	bool needs_redraw();
+
+	// seconds until the next animation frame is due, or -1 if the view is static
+	float time_until_redraw();
+
+	void request_redraw() { redrawRequested = true; }
+
 private:
 	string fpath;
 	Model* m_model;
 	bool legacy_renderer;
 	bool headless;
 	bool valid;
-	uint8_t* mesa3d_buffer;
-
-	GLFWwindow* window;
-	ShaderProgram* mdlShader = NULL;
+	void* mesa3d_context = NULL; // OSMesaContext for headless rendering
+	uint8_t* mesa3d_buffer = NULL;
+	vector<uint8_t> readBuffer; // for reading pixels from a window context
+	SoftRasterizer* softRasterizer = NULL; // used instead of OpenGL if not NULL
+
+	std::list<MdlRenderer*> modelCache; // models that were replaced recently, most recent first
+	MdlRenderer* loadingRenderer = NULL; // model being loaded in the background
+	bool loadingCanceled = false; // a different model was selected while loading
+	std::string loadingHash; // expected md5 of the model being loaded
+	std::future<void> loadingTask;
+
+	// loads that were replaced by a newer one before finishing. They're deleted once their
+	// worker threads are done, so starting a new load never waits for an old one.
+	struct AbandonedLoad {
+		MdlRenderer* renderer;
+		std::future<void> task;
+	};
+	std::list<AbandonedLoad> abandonedLoads;
+
+	bool redrawRequested = true;
+	uint64_t lastFrameTime = 0; // for rotating the model
+	uint64_t lastRenderTime = 0;
+	EntRenderOpts lastRenderOpts; // options used for the last frame, to detect changes
+	int lastRenderWidth = 0;
+	int lastRenderHeight = 0;
+
+	// model fit offsets are cached until the model, sequence, or viewport changes
+	MdlRenderer* fitModel = NULL;
+	int fitSequence = -1;
+	int fitWidth = 0;
+	int fitHeight = 0;
+	vec3 fitAngles;
+	float fitDepthOffset = 0;
+	float fitHeightOffset = 0;
+	bool fitAllYaws = false; // fit the model at every yaw, even if it isn't rotating
+	vec2 fitScale = vec2(1, 1); // fraction of the view width/height that the model must fit in
+
+	GLFWwindow* window = NULL;
+	ShaderVariants* mdlShaders = NULL;
 	ShaderProgram* mdlWireShader = NULL;
 	ShaderProgram* colorShader = NULL;
 	int windowWidth;
@@ -63,7 +193,23 @@ private:
 	bool create_window(int width, int height);
 	bool create_headless_context(int width, int height);
 	void init_gl();
+	bool finish_model_load(MdlRenderer* newRenderer); // upload and replace the current model
+	void set_model(MdlRenderer* newRenderer); // replace the current model, caching the old one
+	void trim_model_cache(); // delete least recently used models until the cache fits its budget
 	void compile_shaders();
-	void get_model_fit_offsets(vec3 modelOrigin, vec3 modelAngles, float& depthOffset, float& heightOffset);
+	void apply_image_params(const ImageParams& params);
+	// frames needed for one loop of the current sequence at the given frame rate
+	int get_loop_frame_count(float fps);
+	// animation frame to draw for the given frame of the loop
+	float get_loop_frame(const ImageParams& params, int idx, float fps);
+	// RGBA pixels of the last rendered frame, top row first. Valid until the next render.
+	uint8_t* get_pixels();
+	// copy the last rendered frame into an image that's dstWidth pixels wide, at (x, y)
+	void read_pixels(uint8_t* dst, int dstWidth, int x, int y);
+	// view-space bounds of the model at the given angles, covering every frame of the sequence
+	void get_model_fit_bounds(vec3 modelAngles, vec3& mins, vec3& maxs);
+	void get_model_fit_offsets(vec3 mins, vec3 maxs, float& depthOffset, float& heightOffset);
+	void update_model_fit(); // recalculates the model fit offsets if the view changed
+	float get_frame_interval(); // seconds between animation frames, or -1 if nothing moves
 	void drawBoxOutline(vec3 center, vec3 mins, vec3 maxs, COLOR4 color);
 };
\ No newline at end of file
@@ -0,0 +1,428 @@
+#include "SoftRasterizer.h"
+#include "util.h"
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#ifdef EMSCRIPTEN
+#include <GLES3/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+
+#define TILE_SIZE 64
+#define SPAN_SIZE 8 // pixels tested at once. Fixed-size loops over spans are vectorized by the compiler.
+
+SoftRasterizer::SoftRasterizer(int width, int height, int numThreads) {
+	this->width = width;
+	this->height = height;
+	setThreadCount(numThreads);
+
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	tileTriangles.resize(tilesX * tilesY);
+
+	colorBuffer = new uint8_t[width * height * 4];
+	depthBuffer = new float[width * height + SPAN_SIZE]; // spans can read past the last pixel
+	clear();
+}
+
+SoftRasterizer::~SoftRasterizer() {
+	delete[] colorBuffer;
+	delete[] depthBuffer;
+}
+
+void SoftRasterizer::setThreadCount(int count) {
+	numThreads = count > 0 ? count : max(1, (int)std::thread::hardware_concurrency());
+}
+
+void SoftRasterizer::clear() {
+	memset(colorBuffer, 0, width * height * 4);
+	std::fill(depthBuffer, depthBuffer + width * height + SPAN_SIZE, 1.0f);
+}
+
+SoftRasterizer::ClipVert SoftRasterizer::shadeVertex(const SoftDrawState& state, const boneVert& vert) {
+	const float* m = state.modelViewProjection.m;
+	const vec3& p = vert.pos;
+
+	ClipVert out;
+	out.pos.x = m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3];
+	out.pos.y = m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7];
+	out.pos.z = m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11];
+	out.pos.w = m[12] * p.x + m[13] * p.y + m[14] * p.z + m[15];
+	out.uv = vec2(vert.uv[0], vert.uv[1]) * state.uvScale;
+
+	if (state.flags & (MDL_SHADER_ADDITIVE | MDL_SHADER_FULLBRIGHT)) {
+		out.color = vec4(1, 1, 1, 1);
+	}
+	else if (state.flags & MDL_SHADER_FLATSHADE) {
+		out.color = vec4(state.ambient * 0.725f, 1);
+	}
+	else {
+		vec3 normal = vec3(vert.normal[0], vert.normal[1], vert.normal[2]) / 127.0f;
+		vec3 finalColor = state.ambient * (96.0f / 255.0f);
+
+		for (int i = 0; i < state.elights && i < 4; i++) {
+			vec3 lightDirection = state.lights[i][0].normalize();
+			float r = 1.5f;
+			float lightcos = (dotProduct(normal, lightDirection) + (r - 1.0f)) / r;
+			finalColor += state.lights[i][1] * lightcos;
+		}
+
+		out.color = vec4(clamp(finalColor.x, 0, 1), clamp(finalColor.y, 0, 1), clamp(finalColor.z, 0, 1), 1);
+	}
+
+	return out;
+}
+
+void SoftRasterizer::drawTriangles(const SoftDrawState& state, const boneVert* verts, const uint32_t* indexes, int numIndexes) {
+	if (numIndexes < 3) {
+		return;
+	}
+
+	int stateIdx = states.size();
+	states.push_back(state);
+
+	// meshes index a small range of the vertex buffer. Shade each vertex in it once.
+	uint32_t minIdx = indexes[0];
+	uint32_t maxIdx = indexes[0];
+	for (int i = 1; i < numIndexes; i++) {
+		minIdx = min(minIdx, indexes[i]);
+		maxIdx = max(maxIdx, indexes[i]);
+	}
+
+	shadedVerts.resize(maxIdx - minIdx + 1);
+	for (uint32_t i = minIdx; i <= maxIdx; i++) {
+		shadedVerts[i - minIdx] = shadeVertex(state, verts[i]);
+	}
+
+	for (int i = 0; i + 2 < numIndexes; i += 3) {
+		ClipVert tri[3] = {
+			shadedVerts[indexes[i] - minIdx],
+			shadedVerts[indexes[i + 1] - minIdx],
+			shadedVerts[indexes[i + 2] - minIdx]
+		};
+		clipTriangle(tri, stateIdx);
+	}
+}
+
+void SoftRasterizer::clipTriangle(const ClipVert* verts, int stateIdx) {
+	// Sutherland-Hodgman against the near plane (z >= -w). The other planes are handled by
+	// limiting the pixel bounds and depth range.
+	ClipVert poly[4];
+	int count = 0;
+
+	for (int i = 0; i < 3; i++) {
+		const ClipVert& a = verts[i];
+		const ClipVert& b = verts[(i + 1) % 3];
+		float da = a.pos.z + a.pos.w;
+		float db = b.pos.z + b.pos.w;
+
+		if (da >= 0) {
+			poly[count++] = a;
+		}
+		if ((da >= 0) != (db >= 0)) {
+			float t = da / (da - db);
+			ClipVert& v = poly[count++];
+			v.pos = a.pos + (b.pos - a.pos) * t;
+			v.uv = a.uv + (b.uv - a.uv) * t;
+			v.color = a.color + (b.color - a.color) * t;
+		}
+	}
+
+	for (int i = 1; i + 1 < count; i++) {
+		addTriangle(poly[0], poly[i], poly[i + 1], stateIdx);
+	}
+}
+
+void SoftRasterizer::addTriangle(const ClipVert& v0, const ClipVert& v1, const ClipVert& v2, int stateIdx) {
+	const ClipVert* v[3] = { &v0, &v1, &v2 };
+
+	Triangle tri;
+	for (int i = 0; i < 3; i++) {
+		float invW = 1.0f / v[i]->pos.w;
+		tri.x[i] = (v[i]->pos.x * invW * 0.5f + 0.5f) * width;
+		tri.y[i] = (v[i]->pos.y * invW * 0.5f + 0.5f) * height;
+		tri.z[i] = v[i]->pos.z * invW * 0.5f + 0.5f;
+		tri.invW[i] = invW;
+		tri.uvW[i] = v[i]->uv * invW;
+		tri.colorW[i] = v[i]->color * invW;
+	}
+
+	// counter-clockwise triangles are front facing (glFrontFace(GL_CCW))
+	float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+	if (area == 0 || (area < 0) == cullBackFaces) {
+		return;
+	}
+
+	if (area < 0) {
+		// wind the other way so that edge functions are positive inside the triangle
+		std::swap(tri.x[1], tri.x[2]);
+		std::swap(tri.y[1], tri.y[2]);
+		std::swap(tri.z[1], tri.z[2]);
+		std::swap(tri.invW[1], tri.invW[2]);
+		std::swap(tri.uvW[1], tri.uvW[2]);
+		std::swap(tri.colorW[1], tri.colorW[2]);
+		area = -area;
+	}
+	tri.area = area;
+
+	tri.minX = max(0, (int)floorf(min(tri.x[0], min(tri.x[1], tri.x[2]))));
+	tri.minY = max(0, (int)floorf(min(tri.y[0], min(tri.y[1], tri.y[2]))));
+	tri.maxX = min(width - 1, (int)ceilf(max(tri.x[0], max(tri.x[1], tri.x[2]))));
+	tri.maxY = min(height - 1, (int)ceilf(max(tri.y[0], max(tri.y[1], tri.y[2]))));
+	if (tri.minX > tri.maxX || tri.minY > tri.maxY) {
+		return;
+	}
+
+	// GL picks the filter by comparing texel and pixel sizes. Compare areas for the whole triangle.
+	const SoftDrawState& state = states[stateIdx];
+	vec2 uv[3];
+	for (int i = 0; i < 3; i++) {
+		uv[i] = tri.uvW[i] / tri.invW[i];
+	}
+	float texelArea = fabs(crossProduct(uv[1] - uv[0], uv[2] - uv[0])) * state.tex->width * state.tex->height;
+	// paletted textures are filtered after the palette lookup (see mdl_frag.glsl)
+	int farFilter = state.palette ? GL_LINEAR : state.tex->farFilter;
+	int filter = texelArea > area ? farFilter : state.tex->nearFilter;
+	tri.linearFilter = filter == GL_LINEAR;
+	tri.state = stateIdx;
+
+	uint32_t triIdx = triangles.size();
+	triangles.push_back(tri);
+
+	for (int ty = tri.minY / TILE_SIZE; ty <= tri.maxY / TILE_SIZE; ty++) {
+		for (int tx = tri.minX / TILE_SIZE; tx <= tri.maxX / TILE_SIZE; tx++) {
+			tileTriangles[ty * tilesX + tx].push_back(triIdx);
+		}
+	}
+}
+
+void SoftRasterizer::finish() {
+	std::atomic<int> nextTile(0);
+	int numTiles = tilesX * tilesY;
+
+	auto worker = [&]() {
+		for (int i = nextTile++; i < numTiles; i = nextTile++) {
+			drawTile(i);
+		}
+	};
+
+	int threadCount = min(numThreads, (int)triangles.size() / 256 + 1); // not worth it for tiny meshes
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for (int i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+
+	for (int i = 0; i < numTiles; i++) {
+		tileTriangles[i].clear();
+	}
+	triangles.clear();
+	states.clear();
+}
+
+void SoftRasterizer::drawTile(int tileIdx) {
+	std::vector<uint32_t>& tris = tileTriangles[tileIdx];
+	int tileX = (tileIdx % tilesX) * TILE_SIZE;
+	int tileY = (tileIdx / tilesX) * TILE_SIZE;
+
+	for (int i = 0; i < tris.size(); i++) {
+		const Triangle& tri = triangles[tris[i]];
+		int x0 = max(tri.minX, tileX);
+		int y0 = max(tri.minY, tileY);
+		int x1 = min(tri.maxX, min(tileX + TILE_SIZE, width) - 1);
+		int y1 = min(tri.maxY, min(tileY + TILE_SIZE, height) - 1);
+
+		if (x0 <= x1 && y0 <= y1) {
+			drawTriangle(tri, x0, y0, x1, y1);
+		}
+	}
+}
+
+void SoftRasterizer::drawTriangle(const Triangle& tri, int x0, int y0, int x1, int y1) {
+	const SoftDrawState& state = states[tri.state];
+
+	// Edge i is opposite vertex i, so its value is the barycentric weight of that vertex.
+	// Pixels exactly on an edge are only drawn for one of the triangles sharing it.
+	float ea[3], eb[3], ec[3];
+	bool inclusive[3];
+	for (int i = 0; i < 3; i++) {
+		int a = (i + 1) % 3;
+		int b = (i + 2) % 3;
+		float dx = tri.x[b] - tri.x[a];
+		float dy = tri.y[b] - tri.y[a];
+		ea[i] = -dy;
+		eb[i] = dx;
+		ec[i] = dy * tri.x[a] - dx * tri.y[a];
+		inclusive[i] = dy < 0 || (dy == 0 && dx < 0);
+	}
+
+	float invArea = 1.0f / tri.area;
+	bool additive = state.additiveBlend;
+	int incl0 = inclusive[0], incl1 = inclusive[1], incl2 = inclusive[2];
+
+	for (int py = y0; py <= y1; py++) {
+		float fy = py + 0.5f;
+
+		for (int sx = x0; sx <= x1; sx += SPAN_SIZE) {
+			int count = min(SPAN_SIZE, x1 - sx + 1);
+			const float* spanDepth = depthBuffer + py * width + sx;
+
+			// Coverage and depth for the whole span, without branches. Lanes past the end of
+			// the span are computed and then masked out.
+			float b0[SPAN_SIZE], b1[SPAN_SIZE], b2[SPAN_SIZE], z[SPAN_SIZE];
+			int pass[SPAN_SIZE];
+			for (int k = 0; k < SPAN_SIZE; k++) {
+				float fx = (sx + k) + 0.5f;
+				float w0 = ea[0] * fx + eb[0] * fy + ec[0];
+				float w1 = ea[1] * fx + eb[1] * fy + ec[1];
+				float w2 = ea[2] * fx + eb[2] * fy + ec[2];
+				int inside = ((w0 > 0) | ((w0 == 0) & incl0))
+					& ((w1 > 0) | ((w1 == 0) & incl1))
+					& ((w2 > 0) | ((w2 == 0) & incl2));
+
+				b0[k] = w0 * invArea;
+				b1[k] = w1 * invArea;
+				b2[k] = w2 * invArea;
+				z[k] = b0[k] * tri.z[0] + b1[k] * tri.z[1] + b2[k] * tri.z[2];
+
+				// GL_LEQUAL depth test, and the depth range
+				pass[k] = inside & (z[k] <= spanDepth[k]) & (z[k] <= 1.0f) & (z[k] >= 0.0f) & (k < count);
+			}
+
+			int mask = 0;
+			for (int k = 0; k < SPAN_SIZE; k++) {
+				mask |= pass[k] << k;
+			}
+			if (!mask) {
+				continue;
+			}
+
+			// texture lookups can't be done in lockstep, so covered pixels are shaded one at a time
+			for (int k = 0; k < count; k++) {
+				if (!(mask & (1 << k))) {
+					continue;
+				}
+
+				float invW = b0[k] * tri.invW[0] + b1[k] * tri.invW[1] + b2[k] * tri.invW[2];
+				float pw = 1.0f / invW;
+				vec2 uv = (tri.uvW[0] * b0[k] + tri.uvW[1] * b1[k] + tri.uvW[2] * b2[k]) * pw;
+				vec4 vertColor = (tri.colorW[0] * b0[k] + tri.colorW[1] * b1[k] + tri.colorW[2] * b2[k]) * pw;
+
+				vec4 frag;
+				if (!shadeFragment(state, uv, vertColor, tri.linearFilter, frag)) {
+					continue; // discarded
+				}
+
+				int offset = py * width + sx + k;
+				depthBuffer[offset] = z[k];
+
+				// glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA or GL_ONE)
+				uint8_t* color = colorBuffer + offset * 4;
+				float src[4] = { clamp(frag.x, 0, 1), clamp(frag.y, 0, 1), clamp(frag.z, 0, 1), clamp(frag.w, 0, 1) };
+				float dstFactor = additive ? 1.0f : 1.0f - src[3];
+
+				for (int c = 0; c < 4; c++) {
+					float v = src[c] * src[3] + (color[c] / 255.0f) * dstFactor;
+					color[c] = (uint8_t)(clamp(v, 0, 1) * 255.0f + 0.5f);
+				}
+			}
+		}
+	}
+}
+
+// GoldSrc player color remapping (see hueReplace in mdl_frag.glsl)
+static vec3 hueReplace(vec3 color, float hue) {
+	float val = max(max(color.x, color.y), color.z);
+	float mincol = min(min(color.x, color.y), color.z);
+	float delta = val - mincol;
+
+	if (hue <= 120.0f) {
+		if (hue < 60.0f)
+			return vec3(val, mincol + hue * delta / (120.0f - hue), mincol);
+		return vec3(mincol + (120.0f - hue) * delta / hue, val, mincol);
+	}
+	else if (hue <= 240.0f) {
+		if (hue < 180.0f)
+			return vec3(mincol, val, mincol + (hue - 120.0f) * delta / (240.0f - hue));
+		return vec3(mincol, mincol + (240.0f - hue) * delta / (hue - 120.0f), val);
+	}
+
+	if (hue < 300.0f)
+		return vec3(mincol + (hue - 240.0f) * delta / (360.0f - hue), mincol, val);
+	return vec3(val, mincol, mincol + (360.0f - hue) * delta / (hue - 240.0f));
+}
+
+vec4 SoftRasterizer::fetchTexel(const SoftDrawState& state, int x, int y) {
+	Texture* tex = state.tex;
+	int w = tex->width;
+	int h = tex->height;
+
+	// GL_REPEAT
+	x = ((x % w) + w) % w;
+	y = ((y % h) + h) % h;
+	int offset = y * w + x;
+
+	if (state.palette) {
+		uint8_t idx = tex->data[offset];
+		vec4 texel = ((COLOR4*)state.palette->data)[idx].toVec();
+
+		if (state.flags & MDL_SHADER_REMAP) {
+			const vec4& r = state.remapRanges;
+			vec3 rgb = vec3(texel.x, texel.y, texel.z);
+
+			if (idx >= r.x && idx <= r.y)
+				rgb = hueReplace(rgb, state.remapHues.x);
+			else if (idx >= r.z && idx <= r.w)
+				rgb = hueReplace(rgb, state.remapHues.y);
+
+			texel = vec4(rgb, texel.w);
+		}
+
+		return texel;
+	}
+
+	if (tex->format == GL_RGBA) {
+		return ((COLOR4*)tex->data)[offset].toVec();
+	}
+	return vec4(((COLOR3*)tex->data)[offset].toVec(), 1.0f);
+}
+
+bool SoftRasterizer::shadeFragment(const SoftDrawState& state, vec2 uv, vec4 color, bool linearFilter, vec4& out) {
+	Texture* tex = state.tex;
+	vec4 texel;
+
+	if (linearFilter) {
+		float tx = uv.x * tex->width - 0.5f;
+		float ty = uv.y * tex->height - 0.5f;
+		int ix = (int)floorf(tx);
+		int iy = (int)floorf(ty);
+		float fx = tx - ix;
+		float fy = ty - iy;
+
+		vec4 top = fetchTexel(state, ix, iy) * (1 - fx) + fetchTexel(state, ix + 1, iy) * fx;
+		vec4 bottom = fetchTexel(state, ix, iy + 1) * (1 - fx) + fetchTexel(state, ix + 1, iy + 1) * fx;
+		texel = top * (1 - fy) + bottom * fy;
+	}
+	else {
+		texel = fetchTexel(state, (int)floorf(uv.x * tex->width), (int)floorf(uv.y * tex->height));
+	}
+
+	if ((state.flags & MDL_SHADER_MASKED) && texel.w < 0.5f) {
+		return false;
+	}
+
+	if ((state.flags & MDL_SHADER_ADDITIVE) && texel.x == 0 && texel.y == 0 && texel.z == 0) {
+		return false; // additive black textures mess up the transparent background
+	}
+
+	out = texel * color * state.colorMult;
+	return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "MdlRenderer.h"
+#include "mat4x4.h"
+#include <vector>
+
+// Shading inputs for a batch of triangles. Matches the uniforms and variant flags of the
+// legacy MDL shaders (mdl_legacy_vert.glsl and mdl_frag.glsl).
+struct SoftDrawState {
+	mat4x4 modelViewProjection; // row-major
+	Texture* tex;
+	Texture* palette; // colors for the indexes in tex, or NULL if tex holds colors
+	vec2 uvScale; // converts vertex texture coordinates to 0-1 (see MdlDrawItem::uvScale)
+	int flags; // MDL_SHADER_* flags
+	vec4 remapRanges; // top color first/last index, bottom color first/last index
+	vec2 remapHues; // top and bottom color hues (0-360)
+	vec4 colorMult;
+	vec3 ambient;
+	vec3 lights[4][3]; // position, diffuse color, unused
+	int elights; // number of active lights
+	bool additiveBlend; // blend with GL_ONE instead of GL_ONE_MINUS_SRC_ALPHA
+};
+
+// Tile-based CPU rasterizer for rendering models without an OpenGL context. Follows the GL
+// state used for headless images: LEQUAL depth test with depth writes, face culling, and
+// SRC_ALPHA blending, with perspective-correct interpolation.
+//
+// Triangles are shaded per vertex and binned into screen tiles as they're drawn. finish()
+// then rasterizes the tiles on worker threads. Each tile draws its triangles in the order
+// they were submitted, so the image doesn't depend on the thread count. Instances share no
+// state, so any number of rasterizers can render on different threads.
+class SoftRasterizer
+{
+public:
+	bool cullBackFaces = true; // false = cull front faces (like glCullFace)
+
+	SoftRasterizer(int width, int height, int numThreads = 0); // 0 = one thread per CPU core
+	~SoftRasterizer();
+
+	void setThreadCount(int count); // 0 = one thread per CPU core
+
+	// fill with transparent black and reset depth
+	void clear();
+
+	// queue triangles for rendering. Indexes point into verts. The state's textures must stay
+	// loaded until finish() is called.
+	void drawTriangles(const SoftDrawState& state, const boneVert* verts, const uint32_t* indexes, int numIndexes);
+
+	// rasterize all queued triangles
+	void finish();
+
+	// RGBA pixels, bottom row first (same layout as glReadPixels and OSMesa buffers)
+	uint8_t* getPixels() { return colorBuffer; }
+
+	int getWidth() { return width; }
+	int getHeight() { return height; }
+
+private:
+	struct ClipVert {
+		vec4 pos; // clip space
+		vec2 uv;
+		vec4 color;
+	};
+
+	struct Triangle {
+		float x[3], y[3], z[3]; // window coordinates
+		float invW[3];
+		vec2 uvW[3]; // attributes divided by w, for perspective-correct interpolation
+		vec4 colorW[3];
+		float area; // twice the window area (always positive)
+		int minX, minY, maxX, maxY; // pixel bounds
+		int state; // index into states
+		bool linearFilter; // texture is minified with a linear filter
+	};
+
+	int width;
+	int height;
+	int numThreads;
+	int tilesX;
+	int tilesY;
+
+	uint8_t* colorBuffer;
+	float* depthBuffer;
+
+	std::vector<SoftDrawState> states;
+	std::vector<Triangle> triangles;
+	std::vector<std::vector<uint32_t>> tileTriangles; // triangle indexes for each tile, in draw order
+	std::vector<ClipVert> shadedVerts; // scratch space for drawTriangles
+
+	ClipVert shadeVertex(const SoftDrawState& state, const boneVert& vert);
+	void clipTriangle(const ClipVert* verts, int stateIdx); // clips against the near plane
+	void addTriangle(const ClipVert& v0, const ClipVert& v1, const ClipVert& v2, int stateIdx);
+	void drawTile(int tileIdx);
+	void drawTriangle(const Triangle& tri, int x0, int y0, int x1, int y1);
+	bool shadeFragment(const SoftDrawState& state, vec2 uv, vec4 color, bool linearFilter, vec4& out);
+	vec4 fetchTexel(const SoftDrawState& state, int x, int y);
+};
@@ -11,7 +11,12 @@ Shader::Shader( const char * sourceCode, int shaderType )
 {
 #ifdef EMSCRIPTEN
 	string sourceCopy = sourceCode;
-	sourceCopy = replaceString(sourceCopy, "#version 120", "#version 100\nprecision highp float;\nprecision highp int;");
+	string header = "#version 100\n";
+	if (shaderType == GL_FRAGMENT_SHADER) {
+		header += "#extension GL_OES_standard_derivatives : enable\n"; // dFdx/dFdy, built into GLSL 1.20
+	}
+	header += "precision highp float;\nprecision highp int;";
+	sourceCopy = replaceString(sourceCopy, "#version 120", header);
 	sourceCode = sourceCopy.c_str();
 #endif
 
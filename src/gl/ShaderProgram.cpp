@@ -8,7 +8,8 @@
 #include "util.h"
 #include <string.h>
 
-static int g_active_shader_program;
+// GL contexts are current per thread, and program IDs are only unique within a context
+static thread_local int g_active_shader_program;
 
 ShaderProgram::ShaderProgram(string name)
 {
@@ -42,6 +43,10 @@ void ShaderProgram::link()
 	glAttachShader(ID, vShader->ID);
 	glAttachShader(ID, fShader->ID);
 
+	for (int i = 0; i < attributeLocations.size(); i++) {
+		glBindAttribLocation(ID, i, attributeLocations[i].c_str());
+	}
+
 	glLinkProgram(ID);
 
 	int success;
@@ -61,6 +66,11 @@ void ShaderProgram::link()
 	else {
 		compiled = true;
 	}
+
+	// new program starts with default uniform values
+	for (int i = 0; i < uniforms.size(); i++) {
+		uniforms[i].shadow.clear();
+	}
 }
 
 
@@ -131,41 +141,56 @@ void ShaderProgram::setVertexAttributeNames(const char* posAtt, const char* colo
 
 	if (posAtt != NULL)
 	{
-		vposID = glGetAttribLocation(ID, posAtt);
+		vposID = getAttributeLocation(posAtt);
 		if (vposID == -1) printf("Could not find vposition attribute: %s in %s shader\n", posAtt, name.c_str());
 	}
 	if (colorAtt != NULL)
 	{
-		vcolorID = glGetAttribLocation(ID, colorAtt);
+		vcolorID = getAttributeLocation(colorAtt);
 		if (vcolorID == -1) printf("Could not find vcolor attribute: %s in %s shader\n", colorAtt, name.c_str());
 	}
 	if (texAtt != NULL)
 	{
-		vtexID = glGetAttribLocation(ID, texAtt);
+		vtexID = getAttributeLocation(texAtt);
 		if (vtexID == -1) printf("Could not find vtexture attribute: %s in %s shader\n", texAtt, name.c_str());
 	}
 	if (normAtt != NULL)
 	{
-		vnormID = glGetAttribLocation(ID, normAtt);
+		vnormID = getAttributeLocation(normAtt);
 		if (vnormID == -1) printf("Could not find vnormal attribute: %s in %s shader\n", normAtt, name.c_str());
 	}
 }
 
-void ShaderProgram::addUniform(string uniformName, uniform_type type) {
+int ShaderProgram::getAttributeLocation(const char* attName) {
+	for (int i = 0; i < attributeLocations.size(); i++) {
+		if (attributeLocations[i] == attName) {
+			return i;
+		}
+	}
+
+	return glGetAttribLocation(ID, attName);
+}
+
+UniformHandle ShaderProgram::addUniform(string uniformName, uniform_type type, bool optional) {
+	ShaderUniform uniform;
+	uniform.name = uniformName;
+	uniform.location = -1;
+	uniform.type = type;
+
+	// Failed uniforms are still added (with location -1, so they're never set). Handles are
+	// indexes, and must refer to the same uniforms in every program that adds them in order.
 	if (type >= UNIFORM_TYPES) {
 		printf("ERROR: Invalid uniform type %d set in %s shader\n", type, name.c_str());
-		return;
+		return addUniformSlot(uniform);
 	}
 
 	bind();
 
-	ShaderUniform uniform;
 	uniform.location = glGetUniformLocation(ID, uniformName.c_str());
-	uniform.type = type;
 	
-	if (uniform.location == -1) {
+	if (uniform.location == -1 && !optional) {
 		printf("ERROR: Uniform %s not found in %s shader\n", uniformName.c_str(), name.c_str());
-		return;
+		return addUniformSlot(uniform);
 	}
 
 	int clearError = glGetError();
@@ -175,7 +200,9 @@ void ShaderProgram::addUniform(string uniformName, uniform_type type) {
 	static float emptyMatrix[16] = { 0.0f };
 
 	// test uniform type and initialize to 0
-	switch (uniform.type) {
+	switch (uniform.location == -1 ? UNIFORM_TYPES : uniform.type) {
+	case UNIFORM_TYPES: // optimized out
+		break;
 	case UNIFORM_FLOAT:
 		glUniform1f(uniform.location, 0.0f);
 		break;
@@ -217,213 +244,325 @@ void ShaderProgram::addUniform(string uniformName, uniform_type type) {
 	int uniError = glGetError();
 	if (uniError == 1282) {
 		printf("ERROR: Wrong uniform type set for %s in shader %s\n", uniformName.c_str(), name.c_str());
-		return;
+		uniform.location = -1;
 	}
 	else if (uniError != 0) {
 		printf("ERROR: Got OpenGL error %d initializing uniform %s in shader %s\n", uniError,
 			uniformName.c_str(), name.c_str());
-		return;
+		uniform.location = -1;
 	}
 
-	uniforms[uniformName] = uniform;
+	return addUniformSlot(uniform);
 }
 
-void ShaderProgram::setUniform(string uniformName, float value) {
-	ShaderUniform uniform = getUniform(uniformName);
+UniformHandle ShaderProgram::addUniformSlot(const ShaderUniform& uniform) {
+	UniformHandle handle;
+
+	auto existing = uniformNames.find(uniform.name);
+	if (existing != uniformNames.end()) {
+		handle.idx = existing->second;
+		uniforms[handle.idx] = uniform;
+	}
+	else {
+		handle.idx = uniforms.size();
+		uniformNames[uniform.name] = handle.idx;
+		uniforms.push_back(uniform);
+	}
+
+	return handle;
+}
+
+UniformHandle ShaderProgram::getUniformHandle(string uniformName) {
+	UniformHandle handle;
+
+	auto uni = uniformNames.find(uniformName);
+
+	if (uni == uniformNames.end()) {
+		string error = "ERROR: Uniform " + uniformName + " was not added to " + name + " shader\n";
+
+		if (loggedErrors.count(error) == 0) {
+			printf(error.c_str());
+			loggedErrors.insert(error);
+		}
+
+		return handle;
+	}
+
+	handle.idx = uni->second;
+	return handle;
+}
+
+ShaderUniform* ShaderProgram::getUniform(UniformHandle handle) {
+	if (handle.idx < 0 || handle.idx >= uniforms.size() || uniforms[handle.idx].location == -1) {
+		return NULL;
+	}
+
+	return &uniforms[handle.idx];
+}
+
+bool ShaderProgram::updateShadow(ShaderUniform& uniform, const void* value, int bytes) {
+	if (uniform.shadow.size() == bytes && !memcmp(&uniform.shadow[0], value, bytes)) {
+		return false;
+	}
+
+	uniform.shadow.resize(bytes);
+	memcpy(&uniform.shadow[0], value, bytes);
+	return true;
+}
+
+void ShaderProgram::logUniformError(ShaderUniform& uniform, const char* typeName) {
+	string error = "ERROR: Can't set uniform " + uniform.name + " as " + typeName + " in shader " + name + ".\n";
+
+	if (loggedErrors.count(error) == 0) {
+		printf(error.c_str());
+		loggedErrors.insert(error);
+	}
+}
+
+void ShaderProgram::setUniform(UniformHandle handle, float value) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_FLOAT) {
-		glUniform1f(uniform.location, value);
+	if (uniform->type == UNIFORM_FLOAT) {
+		if (updateShadow(*uniform, &value, sizeof(float)))
+			glUniform1f(uniform->location, value);
 	}
-	else if (uniform.type == UNIFORM_INT) {
-		glUniform1i(uniform.location, value); // for ease of use with operator overloaded funcs
+	else if (uniform->type == UNIFORM_INT) {
+		int ivalue = value; // for ease of use with operator overloaded funcs
+		if (updateShadow(*uniform, &ivalue, sizeof(int)))
+			glUniform1i(uniform->location, ivalue);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as a float in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "a float");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, vec2 value) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, vec2 value) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_VEC2) {
-		glUniform2f(uniform.location, value.x, value.y);
+	if (uniform->type == UNIFORM_VEC2) {
+		if (updateShadow(*uniform, &value, sizeof(vec2)))
+			glUniform2f(uniform->location, value.x, value.y);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as a vec2 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "a vec2");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, vec3 value) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, vec3 value) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_VEC3) {
-		glUniform3f(uniform.location, value.x, value.y, value.z);
+	if (uniform->type == UNIFORM_VEC3) {
+		if (updateShadow(*uniform, &value, sizeof(vec3)))
+			glUniform3f(uniform->location, value.x, value.y, value.z);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as a vec3 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "a vec3");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, vec4 value) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, vec4 value) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_VEC4) {
-		glUniform4f(uniform.location, value.x, value.y, value.z, value.w);
+	if (uniform->type == UNIFORM_VEC4) {
+		if (updateShadow(*uniform, &value, sizeof(vec4)))
+			glUniform4f(uniform->location, value.x, value.y, value.z, value.w);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as a vec4 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "a vec4");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, int value) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, int value) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_INT) {
-		glUniform1i(uniform.location, value);
+	if (uniform->type == UNIFORM_INT) {
+		if (updateShadow(*uniform, &value, sizeof(int)))
+			glUniform1i(uniform->location, value);
 	}
-	else if (uniform.type == UNIFORM_FLOAT) {
-		glUniform1f(uniform.location, value); // for ease of use with operator overloaded funcs
+	else if (uniform->type == UNIFORM_FLOAT) {
+		float fvalue = value; // for ease of use with operator overloaded funcs
+		if (updateShadow(*uniform, &fvalue, sizeof(float)))
+			glUniform1f(uniform->location, fvalue);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as an int in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "an int");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, int value, int value2) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, int value, int value2) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_IVEC2) {
-		glUniform2i(uniform.location, value, value2);
+	if (uniform->type == UNIFORM_IVEC2) {
+		int values[2] = { value, value2 };
+		if (updateShadow(*uniform, values, sizeof(values)))
+			glUniform2i(uniform->location, value, value2);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as an ivec2 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "an ivec2");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, int value, int value2, int value3) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, int value, int value2, int value3) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_IVEC3) {
-		glUniform3i(uniform.location, value, value2, value3);
+	if (uniform->type == UNIFORM_IVEC3) {
+		int values[3] = { value, value2, value3 };
+		if (updateShadow(*uniform, values, sizeof(values)))
+			glUniform3i(uniform->location, value, value2, value3);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as an ivec3 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "an ivec3");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, int value, int value2, int value3, int value4) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, int value, int value2, int value3, int value4) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	if (uniform.type == UNIFORM_IVEC4) {
-		glUniform4i(uniform.location, value, value2, value3, value4);
+	if (uniform->type == UNIFORM_IVEC4) {
+		int values[4] = { value, value2, value3, value4 };
+		if (updateShadow(*uniform, values, sizeof(values)))
+			glUniform4i(uniform->location, value, value2, value3, value4);
 	}
 	else {
-		printf("ERROR: Can't set uniform %s as an ivec4 in shader %s.\n", uniformName.c_str(), name.c_str());
+		logUniformError(*uniform, "an ivec4");
 	}
 }
 
-void ShaderProgram::setUniform(string uniformName, float* values, int count) {
-	ShaderUniform uniform = getUniform(uniformName);
+void ShaderProgram::setUniform(UniformHandle handle, float* values, int count) {
+	ShaderUniform* uniform = getUniform(handle);
 
-	if (uniform.location == -1)
+	if (!uniform)
 		return;
 
-	switch (uniform.type) {
+	if (uniform->type >= UNIFORM_IVEC2 && uniform->type <= UNIFORM_IVEC4 || uniform->type == UNIFORM_INT) {
+		logUniformError(*uniform, "floats");
+		return;
+	}
+
+	if (!updateShadow(*uniform, values, count * sizeof(float)))
+		return;
+
+	switch (uniform->type) {
 	case UNIFORM_FLOAT:
-		glUniform1fv(uniform.location, count, values);
+		glUniform1fv(uniform->location, count, values);
 		break;
 	case UNIFORM_VEC2:
-		glUniform2fv(uniform.location, count / 2, values);
+		glUniform2fv(uniform->location, count / 2, values);
 		break;
 	case UNIFORM_VEC3:
-		glUniform3fv(uniform.location, count / 3, values);
+		glUniform3fv(uniform->location, count / 3, values);
 		break;
 	case UNIFORM_VEC4:
-		glUniform4fv(uniform.location, count / 4, values);
+		glUniform4fv(uniform->location, count / 4, values);
 		break;
 	case UNIFORM_MAT2:
-		glUniformMatrix2fv(uniform.location, count / 4, false, values);
+		glUniformMatrix2fv(uniform->location, count / 4, false, values);
 		break;
 	case UNIFORM_MAT3:
-		glUniformMatrix3fv(uniform.location, count / 9, false, values);
+		glUniformMatrix3fv(uniform->location, count / 9, false, values);
 		break;
 	case UNIFORM_MAT4:
-		glUniformMatrix4fv(uniform.location, count / 16, false, values);
+		glUniformMatrix4fv(uniform->location, count / 16, false, values);
 		break;
 	default:
-		printf("ERROR: Can't set uniform %s as floats in shader %s.\n", uniformName.c_str(), name.c_str());
 		break;
 	}
 }
 
+void ShaderProgram::setUniform(UniformHandle handle, int* values, int count) {
+	ShaderUniform* uniform = getUniform(handle);
 
-void ShaderProgram::setUniform(string uniformName, int* values, int count) {
-	ShaderUniform uniform = getUniform(uniformName);
+	if (!uniform)
+		return;
+
+	if (uniform->type != UNIFORM_INT && (uniform->type < UNIFORM_IVEC2 || uniform->type > UNIFORM_IVEC4)) {
+		logUniformError(*uniform, "ints");
+		return;
+	}
 
-	if (uniform.location == -1)
+	if (!updateShadow(*uniform, values, count * sizeof(int)))
 		return;
 
-	switch (uniform.type) {
+	switch (uniform->type) {
 	case UNIFORM_INT:
-		glUniform1iv(uniform.location, count, values);
+		glUniform1iv(uniform->location, count, values);
 		break;
 	case UNIFORM_IVEC2:
-		glUniform2iv(uniform.location, count / 2, values);
+		glUniform2iv(uniform->location, count / 2, values);
 		break;
 	case UNIFORM_IVEC3:
-		glUniform3iv(uniform.location, count / 3, values);
+		glUniform3iv(uniform->location, count / 3, values);
 		break;
 	case UNIFORM_IVEC4:
-		glUniform4iv(uniform.location, count / 4, values);
+		glUniform4iv(uniform->location, count / 4, values);
 		break;
 	default:
-		printf("ERROR: Can't set uniform %s as ints in %s shader.\n", uniformName.c_str(), name.c_str());
 		break;
 	}
 }
 
-ShaderUniform ShaderProgram::getUniform(string uniformName) {
-	auto uni = uniforms.find(uniformName);
+void ShaderProgram::setUniform(string uniformName, float value) {
+	setUniform(getUniformHandle(uniformName), value);
+}
 
-	if (uni == uniforms.end()) {
-		string error = "ERROR: Uniform " + uniformName + " was not added to " + name + " shader\n";
+void ShaderProgram::setUniform(string uniformName, vec2 value) {
+	setUniform(getUniformHandle(uniformName), value);
+}
 
-		if (loggedErrors.count(error) == 0) {
-			printf(error.c_str());
-			loggedErrors.insert(error);
-		}
+void ShaderProgram::setUniform(string uniformName, vec3 value) {
+	setUniform(getUniformHandle(uniformName), value);
+}
 
-		ShaderUniform bad;
-		bad.location = -1;
-		bad.type = UNIFORM_FLOAT;
-		return bad;
-	}
+void ShaderProgram::setUniform(string uniformName, vec4 value) {
+	setUniform(getUniformHandle(uniformName), value);
+}
+
+void ShaderProgram::setUniform(string uniformName, int value) {
+	setUniform(getUniformHandle(uniformName), value);
+}
 
-	return uni->second;
+void ShaderProgram::setUniform(string uniformName, int value, int value2) {
+	setUniform(getUniformHandle(uniformName), value, value2);
+}
+
+void ShaderProgram::setUniform(string uniformName, int value, int value2, int value3) {
+	setUniform(getUniformHandle(uniformName), value, value2, value3);
+}
+
+void ShaderProgram::setUniform(string uniformName, int value, int value2, int value3, int value4) {
+	setUniform(getUniformHandle(uniformName), value, value2, value3, value4);
+}
+
+void ShaderProgram::setUniform(string uniformName, float* values, int count) {
+	setUniform(getUniformHandle(uniformName), values, count);
+}
+
+void ShaderProgram::setUniform(string uniformName, int* values, int count) {
+	setUniform(getUniformHandle(uniformName), values, count);
 }
 
 void ShaderProgram::pushMatrix(int matType)
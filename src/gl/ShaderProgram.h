@@ -32,8 +32,15 @@ enum uniform_type {
 };
 
 struct ShaderUniform {
+	string name;
 	uint32_t location;
 	uniform_type type;
+	std::vector<uint8_t> shadow; // last uploaded value, used to skip redundant uploads
+};
+
+// Returned by addUniform. Setting a uniform by handle skips the name lookup.
+struct UniformHandle {
+	int idx = -1;
 };
 
 class ShaderProgram
@@ -56,7 +63,12 @@ public:
 	mat4x4* viewMat;
 	mat4x4* modelMat;
 
-	unordered_map<string, ShaderUniform> uniforms; // custom uniforms
+	// attribute names that are bound to their index before linking, so that
+	// programs compiled from the same source can share vertex buffers
+	std::vector<string> attributeLocations;
+
+	std::vector<ShaderUniform> uniforms; // custom uniforms
+	unordered_map<string, int> uniformNames; // index into uniforms
 	unordered_set<string> loggedErrors; // prevent error spam
 
 	// Creates a shader program to replace the fixed-function pipeline
@@ -81,9 +93,30 @@ public:
 	// Find the IDs for the common vertex attributes (position, color, texture coords, normals)
 	void setVertexAttributeNames(const char* posAtt, const char* colorAtt, const char* texAtt, const char* normAtt);
 
-	// get the location of a uniform in a linked program
-	void addUniform(string uniformName, uniform_type type);
-
+	// get the location of a vertex attribute, preferring the locations in attributeLocations
+	int getAttributeLocation(const char* attName);
+
+	// get the location of a uniform in a linked program. Uniforms are added even if they were
+	// optimized out or failed to initialize, so handle indexes match between variants.
+	UniformHandle addUniform(string uniformName, uniform_type type, bool optional=false);
+
+	// get the handle of a uniform that was already added
+	UniformHandle getUniformHandle(string uniformName);
+
+	// Set uniforms for the currently bound program. Values are only
+	// uploaded if they differ from what was last set for this program.
+	void setUniform(UniformHandle uniform, float value);
+	void setUniform(UniformHandle uniform, vec2 value);
+	void setUniform(UniformHandle uniform, vec3 values);
+	void setUniform(UniformHandle uniform, vec4 values);
+	void setUniform(UniformHandle uniform, int value);
+	void setUniform(UniformHandle uniform, int value0, int value1);
+	void setUniform(UniformHandle uniform, int value0, int value1, int value2);
+	void setUniform(UniformHandle uniform, int value0, int value1, int value2, int value3);
+	void setUniform(UniformHandle uniform, float* values, int count=1);
+	void setUniform(UniformHandle uniform, int* values, int count=1);
+
+	// name lookup versions of the above (slower)
 	void setUniform(string uniformName, float value);
 	void setUniform(string uniformName, vec2 value);
 	void setUniform(string uniformName, vec3 values);
@@ -120,5 +153,14 @@ private:
 
 	void link();
 
-	ShaderUniform getUniform(string name);
+	// returns NULL if the handle is invalid or the uniform is unused
+	ShaderUniform* getUniform(UniformHandle handle);
+
+	// returns false if the value matches the last value uploaded for the uniform
+	bool updateShadow(ShaderUniform& uniform, const void* value, int bytes);
+
+	void logUniformError(ShaderUniform& uniform, const char* typeName);
+
+	// add or replace a uniform by name and return its handle
+	UniformHandle addUniformSlot(const ShaderUniform& uniform);
 };
@@ -0,0 +1,60 @@
+#include "ShaderVariants.h"
+#include "util.h"
+
+ShaderVariants::ShaderVariants(string name, const char* vshaderSource, const char* fshaderSource, std::vector<string> flagNames)
+{
+	this->name = name;
+	this->vshaderSource = vshaderSource;
+	this->fshaderSource = fshaderSource;
+	this->flagNames = flagNames;
+}
+
+ShaderVariants::~ShaderVariants() {
+	for (auto& item : variants) {
+		delete item.second;
+	}
+}
+
+ShaderProgram* ShaderVariants::get(int flags) {
+	auto existing = variants.find(flags);
+	if (existing != variants.end()) {
+		return existing->second;
+	}
+
+	string defines;
+	string variantName = name;
+
+	for (int i = 0; i < flagNames.size(); i++) {
+		if (flags & (1 << i)) {
+			defines += "#define " + flagNames[i] + "\n";
+			variantName += "_" + flagNames[i];
+		}
+	}
+
+	string vsource = addDefines(vshaderSource, defines);
+	string fsource = addDefines(fshaderSource, defines);
+
+	ShaderProgram* program = new ShaderProgram(variantName);
+	program->attributeLocations = attributeLocations;
+	program->compile(vsource.c_str(), fsource.c_str());
+
+	if (setup) {
+		setup(program);
+	}
+
+	variants[flags] = program;
+	return program;
+}
+
+string ShaderVariants::addDefines(const char* source, const string& defines) {
+	string src = source;
+
+	// defines must come after the #version directive
+	size_t insertPos = 0;
+	if (src.find("#version") == 0) {
+		insertPos = src.find('\n');
+		insertPos = insertPos == string::npos ? src.size() : insertPos + 1;
+	}
+
+	return src.insert(insertPos, defines);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "ShaderProgram.h"
+#include <functional>
+
+// Permutations of a shader program compiled from the same source. Each set bit in a
+// variant's flags adds "#define <flag name>" after the #version line of both shaders.
+// Variants are compiled on first use.
+class ShaderVariants
+{
+public:
+	string name;
+
+	// copied to every variant before it is linked (see ShaderProgram::attributeLocations)
+	std::vector<string> attributeLocations;
+
+	// called after a variant is compiled, to set up matrices and uniforms. Add uniforms
+	// in the same order for every variant so that handles can be used with any of them.
+	std::function<void(ShaderProgram*)> setup;
+
+	ShaderVariants(string name, const char* vshaderSource, const char* fshaderSource, std::vector<string> flagNames);
+	~ShaderVariants();
+
+	ShaderProgram* get(int flags);
+
+private:
+	const char* vshaderSource;
+	const char* fshaderSource;
+	std::vector<string> flagNames;
+	unordered_map<int, ShaderProgram*> variants;
+
+	string addDefines(const char* source, const string& defines);
+};
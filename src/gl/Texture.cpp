@@ -8,8 +8,8 @@ bool isPowerOf2(int n) {
 Texture::Texture(int width, int height) {
 	this->width = width;
 	this->height = height;
-	this->nearFilter = GL_LINEAR;
-	this->farFilter = GL_LINEAR_MIPMAP_LINEAR;
+	this->nearFilter = GL_NEAREST;
+	this->farFilter = GL_LINEAR;
 	this->data = new uint8_t[width*height*sizeof(COLOR4)];
 	layer = 0;
 }
@@ -17,8 +17,8 @@ Texture::Texture(int width, int height) {
 Texture::Texture(int width, int height, int depth) {
 	this->width = width;
 	this->height = height;
-	this->nearFilter = GL_LINEAR;
-	this->farFilter = GL_LINEAR_MIPMAP_LINEAR;
+	this->nearFilter = GL_NEAREST;
+	this->farFilter = GL_LINEAR;
 	this->data = new uint8_t[width * height * depth * sizeof(COLOR4)];
 	layer = 0;
 }
@@ -27,8 +27,8 @@ Texture::Texture( int width, int height, void * data )
 {
 	this->width = width;
 	this->height = height;
-	this->nearFilter = GL_LINEAR;
-	this->farFilter = GL_LINEAR_MIPMAP_LINEAR;
+	this->nearFilter = GL_NEAREST;
+	this->farFilter = GL_LINEAR;
 	this->data = (uint8_t*)data;
 	layer = 0;
 }
@@ -66,19 +66,42 @@ void Texture::upload(int format)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrapMode); // Note: GL_CLAMP is significantly slower
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrapMode);
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, farFilter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, nearFilter);
 
-	if (format == GL_RGB) {
+	if (format != GL_RGBA) {
 		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	}
 
-	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+	int gpuFormat = internalFormat ? internalFormat : format;
+	glTexImage2D(GL_TEXTURE_2D, 0, gpuFormat, width, height, 0, format, GL_UNSIGNED_BYTE, data);
 	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
 
 	uploaded = true;
 }
 
+void Texture::freeData()
+{
+	delete[] data;
+	data = NULL;
+}
+
+size_t Texture::getGpuBytes()
+{
+	if (!uploaded) {
+		return 0;
+	}
+
+	int gpuFormat = internalFormat ? internalFormat : format;
+	int bytesPerPixel = 4;
+	if (gpuFormat == GL_RGB)
+		bytesPerPixel = 3;
+	else if (gpuFormat == GL_R8 || gpuFormat == GL_RED)
+		bytesPerPixel = 1;
+
+	return (size_t)width * height * bytesPerPixel;
+}
+
 void Texture::bind()
 {
 	glBindTexture(GL_TEXTURE_2D, id);
@@ -9,10 +9,11 @@ public:
 	uint32_t id; // OpenGL texture ID
 	int layer; // layer in the texture array. 0 if not in an array or at layer 0
 	uint32_t height, width;
-	uint8_t * data; // RGB(A) data
-	int nearFilter;
-	int farFilter;
+	uint8_t * data; // pixel data in the given format
+	int nearFilter; // magnification filter
+	int farFilter; // minification filter
 	uint32_t format = 0; // format of the data
+	uint32_t internalFormat = 0; // format of the texture on the GPU (0 = same as format)
 	bool uploaded = false;
 
 	Texture(int width, int height);
@@ -23,6 +24,12 @@ public:
 	// upload the texture with the specified settings
 	void upload(int format);
 
+	// delete the pixel data after uploading. The texture can't be uploaded again after this.
+	void freeData();
+
+	// estimated size of the texture in GPU memory
+	size_t getGpuBytes();
+
 	// use this texture for rendering
 	void bind();
 };
\ No newline at end of file
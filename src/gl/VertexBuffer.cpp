@@ -140,7 +140,7 @@ void VertexBuffer::setShader(ShaderProgram* program, bool hideErrors) {
 	attributesBound = false;
 	for (int i = 0; i < attribs.size(); i++)
 	{
-		if (strlen(attribs[i].varName) > 0) {
+		if (attribs[i].varName && strlen(attribs[i].varName) > 0) {
 			attribs[i].handle = -1;
 		}
 	}
@@ -160,10 +160,10 @@ void VertexBuffer::bindAttributes(bool hideErrors) {
 
 	for (int i = 0; i < attribs.size(); i++)
 	{
-		if (attribs[i].handle != -1)
-			continue;
+		if (attribs[i].handle != -1 || !attribs[i].varName)
+			continue; // already bound or padding
 
-		attribs[i].handle = glGetAttribLocation(shaderProgram->ID, attribs[i].varName);
+		attribs[i].handle = shaderProgram->getAttributeLocation(attribs[i].varName);
 
 		if (attribs[i].handle == -1)
 			printf("Could not find vertex attribute: %s\n", attribs[i].varName);
@@ -178,6 +178,18 @@ void VertexBuffer::setData(const void* data, int numVerts)
 	this->numVerts = numVerts;
 }
 
+void VertexBuffer::setIndexes(const uint32_t* indexes, int numIndexes)
+{
+	this->indexes = (uint32_t*)indexes;
+	this->numIndexes = numIndexes;
+}
+
+void VertexBuffer::shareVertexData(VertexBuffer* other)
+{
+	sharedVertexData = other;
+	setData(other->data, other->numVerts);
+}
+
 bool VertexBuffer::isUploaded() {
 	return vboId != -1;
 }
@@ -186,21 +198,43 @@ void VertexBuffer::upload() {
 	if (vboId != -1) {
 		// already uploaded, just replace the data
 		shaderProgram->bind();
-		glBindBuffer(GL_ARRAY_BUFFER, vboId);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, elementSize * numVerts, data);
+		if (!sharedVertexData) {
+			glBindBuffer(GL_ARRAY_BUFFER, vboId);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, elementSize * numVerts, data);
+		}
+		if (iboId != -1 && indexes) {
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboId);
+			glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, numIndexes * sizeof(uint32_t), indexes);
+		}
 		return;
 	}
 
 	bindAttributes();
 
+	if (sharedVertexData && !sharedVertexData->isUploaded()) {
+		sharedVertexData->upload();
+	}
+
 	if (g_use_vao) {
 		glGenVertexArrays(1, &vaoId);
 		glBindVertexArray(vaoId);
 	}
 
-	glGenBuffers(1, &vboId);
-	glBindBuffer(GL_ARRAY_BUFFER, vboId);
-	glBufferData(GL_ARRAY_BUFFER, elementSize * numVerts, data, GL_STATIC_DRAW);	
+	if (sharedVertexData) {
+		vboId = sharedVertexData->vboId;
+		glBindBuffer(GL_ARRAY_BUFFER, vboId);
+	}
+	else {
+		glGenBuffers(1, &vboId);
+		glBindBuffer(GL_ARRAY_BUFFER, vboId);
+		glBufferData(GL_ARRAY_BUFFER, elementSize * numVerts, data, GL_STATIC_DRAW);
+	}
+
+	if (indexes) {
+		glGenBuffers(1, &iboId);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboId);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndexes * sizeof(uint32_t), indexes, GL_STATIC_DRAW);
+	}
 
 	if (g_use_vao) {
 		int offset = 0;
@@ -222,29 +256,31 @@ void VertexBuffer::upload() {
 }
 
 void VertexBuffer::deleteBuffer() {
-	if (vboId != -1)
+	if (vboId != -1 && !sharedVertexData)
 		glDeleteBuffers(1, &vboId);
+	if (iboId != -1)
+		glDeleteBuffers(1, &iboId);
 	if (vaoId != -1)
 		glDeleteBuffers(1, &vaoId);
 	vboId = -1;
+	iboId = -1;
 	vaoId = -1;
 }
 
-void VertexBuffer::drawRange(int primitive, int start, int end)
+void VertexBuffer::bind(ShaderProgram* program)
 {
-	if (vboId == -1) {
-		printf("Attempted to draw VBO before upload\n");
-		upload();
-		return;
-	}
-
-	shaderProgram->bind();
 	bindAttributes();
+	if (program)
+		program->bind();
+	else
+		shaderProgram->bind();
 
 	if (vaoId != -1)
 		glBindVertexArray(vaoId);
 	else {
 		glBindBuffer(GL_ARRAY_BUFFER, vboId);
+		if (iboId != -1)
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboId);
 
 		int offset = 0;
 		for (int i = 0; i < attribs.size(); i++)
@@ -259,16 +295,10 @@ void VertexBuffer::drawRange(int primitive, int start, int end)
 			glVertexAttribPointer(a.handle, a.numValues, a.valueType, a.normalized != 0, elementSize, ptr);
 		}
 	}
+}
 
-	if (start < 0 || start > numVerts)
-		printf("Invalid start index: %d\n", start);
-	else if (end > numVerts || end < 0)
-		printf("Invalid end index: %d\n", end);
-	else if (end - start <= 0)
-		printf("Invalid draw range: %d -> %d\n", start, end);
-	else
-		glDrawArrays(primitive, start, end - start);
-
+void VertexBuffer::unbind()
+{
 	if (vaoId == -1) {
 		// my windows 7 opengl 3.0 netbook needs this or else it crashes
 		for (int i = 0; i < attribs.size(); i++)
@@ -282,7 +312,36 @@ void VertexBuffer::drawRange(int primitive, int start, int end)
 	}
 }
 
-void VertexBuffer::draw(int primitive)
+void VertexBuffer::drawBoundRange(int primitive, int start, int end)
+{
+	int count = iboId != -1 ? numIndexes : numVerts;
+
+	if (start < 0 || start > count)
+		printf("Invalid start index: %d\n", start);
+	else if (end > count || end < 0)
+		printf("Invalid end index: %d\n", end);
+	else if (end - start <= 0)
+		printf("Invalid draw range: %d -> %d\n", start, end);
+	else if (iboId != -1)
+		glDrawElements(primitive, end - start, GL_UNSIGNED_INT, (void*)(start * sizeof(uint32_t)));
+	else
+		glDrawArrays(primitive, start, end - start);
+}
+
+void VertexBuffer::drawRange(int primitive, int start, int end, ShaderProgram* program)
+{
+	if (vboId == -1) {
+		printf("Attempted to draw VBO before upload\n");
+		upload();
+		return;
+	}
+
+	bind(program);
+	drawBoundRange(primitive, start, end);
+	unbind();
+}
+
+void VertexBuffer::draw(int primitive, ShaderProgram* program)
 {
-	drawRange(primitive, 0, numVerts);
+	drawRange(primitive, 0, (indexes || iboId != -1) ? numIndexes : numVerts, program);
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <stdint.h>
 
 class ShaderProgram;
 
@@ -52,6 +53,8 @@ public:
 	int elementSize;
 	int numVerts;
 	bool ownData = false; // set to true if buffer should delete data on destruction
+	uint32_t* indexes = NULL; // optional element indexes into the vertex data
+	int numIndexes = 0;
 
 	// Specify which common attributes to use. They will be located in the
 	// shader program. If passing data, note that data is not copied, but referenced
@@ -63,13 +66,30 @@ public:
 	//       Data will be deleted when the buffer is destroyed.
 	void setData(const void * data, int numVerts);
 
+	// Draw with indexes instead of drawing vertices in order. Indexes are not copied either.
+	// After uploading, indexes can be set to NULL (keeping numIndexes) if they won't change.
+	void setIndexes(const uint32_t* indexes, int numIndexes);
+
+	// Read vertex data from another buffer's VBO instead of uploading a copy. The attribute layout
+	// of this buffer must match the other buffer. Use NULL attribute names to skip unused attributes.
+	void shareVertexData(VertexBuffer* other);
+
 	bool isUploaded();
 	void upload();
 	void deleteBuffer();
 	void setShader(ShaderProgram* program, bool hideErrors=false);
 
-	void drawRange(int primitive, int start, int end);
-	void draw(int primitive);
+	// start/end are vertex indexes, or element indexes if the buffer has indexes.
+	// program overrides the shader used for drawing. Its attribute locations must
+	// match the shader the buffer was created with (see ShaderProgram::attributeLocations).
+	void drawRange(int primitive, int start, int end, ShaderProgram* program=NULL);
+	void draw(int primitive, ShaderProgram* program=NULL);
+
+	// For drawing many ranges from the same buffer. Bind once, draw the ranges, then unbind.
+	// Shaders can be changed between draws if they share attribute locations.
+	void bind(ShaderProgram* program=NULL);
+	void drawBoundRange(int primitive, int start, int end);
+	void unbind();
 
 	void addAttribute(int numValues, int valueType, int normalized, const char* varName);
 	void addAttribute(int type, const char* varName);
@@ -79,6 +99,8 @@ private:
 	ShaderProgram * shaderProgram = NULL; // for getting handles to vertex attributes
 	uint32_t vboId = -1;
 	uint32_t vaoId = -1; // vertex array object (binds attributes to the buffer)
+	uint32_t iboId = -1; // element buffer
+	VertexBuffer* sharedVertexData = NULL; // buffer that owns the VBO, if not this one
 	bool attributesBound = false;
 
 	// add attributes according to the attribute flags
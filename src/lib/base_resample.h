@@ -174,7 +174,7 @@ inline float32 lanczos_weight(float32 f_n, float32 distance) {
   return 0.0f;
 }
 
-bool SampleKernelBilinearH(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBilinearH(uint8* src, uint32 src_width, uint32 src_height,
                            float32 f_x, float32 f_y, uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
     return false;
@@ -203,7 +203,7 @@ bool SampleKernelBilinearH(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelBilinearV(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBilinearV(uint8* src, uint32 src_width, uint32 src_height,
                            float32 f_x, float32 f_y, uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
     return false;
@@ -232,7 +232,7 @@ bool SampleKernelBilinearV(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelBilinear(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBilinear(uint8* src, uint32 src_width, uint32 src_height,
                           KernelDirection direction, float32 f_x, float32 f_y,
                           uint8* output) {
   switch (direction) {
@@ -247,7 +247,7 @@ bool SampleKernelBilinear(uint8* src, uint32 src_width, uint32 src_height,
   return false;
 }
 
-bool SampleKernelBicubicH(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBicubicH(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 coeff_b,
                           float32 coeff_c, uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -290,7 +290,7 @@ bool SampleKernelBicubicH(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelBicubicV(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBicubicV(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 coeff_b,
                           float32 coeff_c, uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -332,7 +332,7 @@ bool SampleKernelBicubicV(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelBicubic(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelBicubic(uint8* src, uint32 src_width, uint32 src_height,
                          KernelDirection direction, float32 f_x, float32 f_y,
                          float32 coeff_b, float32 coeff_c, uint8* output) {
   switch (direction) {
@@ -347,7 +347,7 @@ bool SampleKernelBicubic(uint8* src, uint32 src_width, uint32 src_height,
   return false;
 }
 
-bool SampleKernelLanczosH(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelLanczosH(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 coeff_a,
                           uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -391,7 +391,7 @@ bool SampleKernelLanczosH(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelLanczosV(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelLanczosV(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 coeff_a,
                           uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -435,7 +435,7 @@ bool SampleKernelLanczosV(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelLanczos(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelLanczos(uint8* src, uint32 src_width, uint32 src_height,
                          KernelDirection direction, float32 f_x, float32 f_y,
                          float32 coeff_a, uint8* output) {
   switch (direction) {
@@ -450,7 +450,7 @@ bool SampleKernelLanczos(uint8* src, uint32 src_width, uint32 src_height,
   return false;
 }
 
-bool SampleKernelAverageH(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelAverageH(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 h_ratio,
                           uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -511,7 +511,7 @@ bool SampleKernelAverageH(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelAverageV(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelAverageV(uint8* src, uint32 src_width, uint32 src_height,
                           float32 f_x, float32 f_y, float32 v_ratio,
                           uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -572,7 +572,7 @@ bool SampleKernelAverageV(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelGaussianH(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelGaussianH(uint8* src, uint32 src_width, uint32 src_height,
                            float32 f_x, float32 f_y, float32 h_ratio,
                            uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -617,7 +617,7 @@ bool SampleKernelGaussianH(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelGaussianV(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelGaussianV(uint8* src, uint32 src_width, uint32 src_height,
                            float32 f_x, float32 f_y, float32 v_ratio,
                            uint8* output) {
   if (!src || !src_width || !src_height || f_x < 0 || f_y < 0 || !output) {
@@ -662,7 +662,7 @@ bool SampleKernelGaussianV(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernelAverage(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelAverage(uint8* src, uint32 src_width, uint32 src_height,
                          KernelDirection direction, float32 f_x, float32 f_y,
                          float32 h_ratio, float32 v_ratio, uint8* output) {
   switch (direction) {
@@ -677,7 +677,7 @@ bool SampleKernelAverage(uint8* src, uint32 src_width, uint32 src_height,
   return false;
 }
 
-bool SampleKernelGaussian(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelGaussian(uint8* src, uint32 src_width, uint32 src_height,
                           KernelDirection direction, float32 f_x, float32 f_y,
                           float32 h_ratio, float32 v_ratio, uint8* output) {
   switch (direction) {
@@ -692,7 +692,7 @@ bool SampleKernelGaussian(uint8* src, uint32 src_width, uint32 src_height,
   return false;
 }
 
-bool SampleKernelNearest(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernelNearest(uint8* src, uint32 src_width, uint32 src_height,
                          float32 f_x, float32 f_y, uint8* output) {
   if (!src || !src_width || !src_height || !output) {
     return false;
@@ -714,7 +714,7 @@ bool SampleKernelNearest(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
-bool SampleKernel(uint8* src, uint32 src_width, uint32 src_height,
+inline bool SampleKernel(uint8* src, uint32 src_width, uint32 src_height,
                   KernelDirection direction, float32 f_x, float32 f_y,
                   KernelType type, float32 h_ratio, float32 v_ratio,
                   uint8* output) {
@@ -766,7 +766,7 @@ bool SampleKernel(uint8* src, uint32 src_width, uint32 src_height,
 }
 
 /* Resamples a 24 bit RGB image using a bilinear, bicubic, or lanczos filter. */
-bool ResampleImage24(uint8* src, uint32 src_width, uint32 src_height,
+inline bool ResampleImage24(uint8* src, uint32 src_width, uint32 src_height,
                      uint8* dst, uint32 dst_width, uint32 dst_height,
                      KernelType type, ::std::string* errors = nullptr) {
   if (!src || !dst || !src_width || !src_height || !dst_width || !dst_height ||
@@ -869,6 +869,55 @@ bool ResampleImage24(uint8* src, uint32 src_width, uint32 src_height,
   return true;
 }
 
+/* Resamples a 32 bit RGBA image. Colors are weighted by alpha before filtering
+   so that the colors of transparent pixels don't bleed into visible edges. */
+inline bool ResampleImage32(uint8* src, uint32 src_width, uint32 src_height,
+                            uint8* dst, uint32 dst_width, uint32 dst_height,
+                            KernelType type, ::std::string* errors = nullptr) {
+  if (!src || !dst || !src_width || !src_height || !dst_width || !dst_height) {
+    if (errors) {
+      *errors = "Invalid parameter passed to ResampleImage32.";
+    }
+    return false;
+  }
+
+  uint32 src_pixels = src_width * src_height;
+  uint32 dst_pixels = dst_width * dst_height;
+
+  /* split into premultiplied color and alpha images, which are resampled
+     separately with the 24 bit resampler. */
+  ::std::unique_ptr<uint8[]> src_color(new uint8[src_pixels * 3]);
+  ::std::unique_ptr<uint8[]> src_alpha(new uint8[src_pixels * 3]);
+  ::std::unique_ptr<uint8[]> dst_color(new uint8[dst_pixels * 3]);
+  ::std::unique_ptr<uint8[]> dst_alpha(new uint8[dst_pixels * 3]);
+
+  for (uint32 i = 0; i < src_pixels; i++) {
+    uint32 alpha = src[i * 4 + 3];
+    for (uint32 c = 0; c < 3; c++) {
+      src_color[i * 3 + c] = (src[i * 4 + c] * alpha + 127) / 255;
+      src_alpha[i * 3 + c] = alpha;
+    }
+  }
+
+  if (!ResampleImage24(src_color.get(), src_width, src_height, dst_color.get(),
+                       dst_width, dst_height, type, errors) ||
+      !ResampleImage24(src_alpha.get(), src_width, src_height, dst_alpha.get(),
+                       dst_width, dst_height, type, errors)) {
+    return false;
+  }
+
+  for (uint32 i = 0; i < dst_pixels; i++) {
+    uint32 alpha = dst_alpha[i * 3];
+    for (uint32 c = 0; c < 3; c++) {
+      uint32 color = dst_color[i * 3 + c];
+      dst[i * 4 + c] = alpha ? clip_range((color * 255 + alpha / 2) / alpha, 0, 255) : 0;
+    }
+    dst[i * 4 + 3] = alpha;
+  }
+
+  return true;
+}
+
 }  // namespace base
 
 #endif  // __BASE_RESAMPLE_H__
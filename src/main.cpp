@@ -2,13 +2,21 @@
 #include "studio.h"
 #include "Model.h"
 #include "Renderer.h"
+#include "ImageCache.h"
+#include "PngEncodeQueue.h"
 #include <string>
 #include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
 
 #if defined(WIN32) || defined(_WIN32)
 #include <Windows.h>
 #include <direct.h>
+#include <io.h>
+#include <fcntl.h>
 #define GetCurrentDir _getcwd
 #else
 #include <time.h>
@@ -245,19 +253,213 @@ void data_layout_model(string inputFile) {
 int view_model(string inputFile) {
 	bool legacy = false;
 	bool headless = false;
-	Renderer renderer = Renderer(inputFile, 500, 800, legacy, headless);
+	Renderer renderer(inputFile, 500, 800, legacy, headless);
 	renderer.render_loop();
 	return 0;
 }
 
-int image_model(string inputFile, string outputFile, int width, int height) {
+// parse a --name=value option for rendered images. Returns false if arg isn't one.
+bool parse_image_option(string arg, ImageParams& params) {
+	size_t eq = arg.find("=");
+	if (arg.find("--") != 0 || eq == string::npos) {
+		return false;
+	}
+
+	string name = arg.substr(2, eq - 2);
+	const char* value = arg.c_str() + eq + 1;
+
+	if (name == "sequence") params.sequence = atoi(value);
+	else if (name == "frame") params.frame = atof(value);
+	else if (name == "yaw") params.yaw = atof(value);
+	else if (name == "pitch") params.pitch = atof(value);
+	else if (name == "body") params.body = atoi(value);
+	else if (name == "skin") params.skin = atoi(value);
+	else if (name == "topcolor") params.topcolor = atoi(value);
+	else if (name == "bottomcolor") params.bottomcolor = atoi(value);
+	else if (name == "grid") {
+		params.gridAngles = max(1, atoi(value));
+		size_t xidx = arg.find("x", eq);
+		params.gridFrames = xidx != string::npos ? max(1, atoi(arg.c_str() + xidx + 1)) : 1;
+	}
+	else return false;
+
+	return true;
+}
+
+// save the model at the main size and each of the extra sizes, from a single render
+int image_model_sizes(string inputFile, string outputFile, int width, int height, vector<ImageSize> extraSizes, bool software, const ImageParams& params) {
+	string basePath = outputFile;
+	if (basePath.size() > 4 && toLowerCase(basePath.substr(basePath.size() - 4)) == ".png") {
+		basePath = basePath.substr(0, basePath.size() - 4);
+	}
+
+	vector<ImageSize> sizes;
+	sizes.push_back({ width, height, outputFile });
+	int renderWidth = width;
+	int renderHeight = height;
+
+	for (ImageSize size : extraSizes) {
+		size.path = basePath + "_" + to_string(size.width) + "x" + to_string(size.height) + ".png";
+		sizes.push_back(size);
+		renderWidth = max(renderWidth, size.width);
+		renderHeight = max(renderHeight, size.height);
+	}
+
 	bool legacy = true;
 	bool headless = true;
-	Renderer renderer = Renderer(inputFile, width, height, legacy, headless);
-	renderer.create_image(outputFile);
+	Renderer renderer(inputFile, renderWidth, renderHeight, legacy, headless, software);
+	return renderer.create_images(sizes, params) ? 0 : 1;
+}
+
+// cache = skip rendering if the same image was rendered before (can be NULL)
+int image_model(string inputFile, string outputFile, int width, int height, bool software, const ImageParams& params, ImageCache* cache) {
+	string cacheKey;
+	if (cache) {
+		cacheKey = cache->getKey(inputFile, width, height, software, params);
+		bool cached = cache->load(cacheKey, outputFile);
+		cache->printStats();
+		if (cached) {
+			return 0;
+		}
+	}
+
+	bool legacy = true;
+	bool headless = true;
+	Renderer renderer(inputFile, width, height, legacy, headless, software);
+	if (!renderer.create_image(outputFile, params)) {
+		return 1;
+	}
+
+	if (cache) {
+		cache->store(cacheKey, outputFile);
+	}
 	return 0;
 }
 
+// render one loop of the sequence as uncompressed video. outputFile "-" = stdout.
+int stream_model(string inputFile, string outputFile, int width, int height, bool software, const ImageParams& params, string format, float fps) {
+	FILE* out;
+	if (outputFile == "-") {
+		// keep log messages out of the stream by sending them to stderr
+		fflush(stdout);
+		int fd = dup(fileno(stdout));
+		dup2(fileno(stderr), fileno(stdout));
+#if defined(WIN32) || defined(_WIN32)
+		_setmode(fd, _O_BINARY);
+#endif
+		out = fdopen(fd, "wb");
+	}
+	else {
+		out = fopen(outputFile.c_str(), "wb");
+	}
+
+	if (!out) {
+		cout << "ERROR: Failed to open " << outputFile << endl;
+		return 1;
+	}
+
+	bool legacy = true;
+	bool headless = true;
+	Renderer renderer(inputFile, width, height, legacy, headless, software);
+	bool ok = renderer.stream_frames(out, fps, format == "y4m", params);
+	fclose(out);
+
+	return ok ? 0 : 1;
+}
+
+int animate_model(string inputFile, string outputFile, int width, int height, bool software, const ImageParams& params, float fps) {
+	bool legacy = true;
+	bool headless = true;
+	Renderer renderer(inputFile, width, height, legacy, headless, software);
+	return renderer.create_animation(outputFile, fps, params) ? 0 : 1;
+}
+
+// render images for every model listed in a file (one path per line). Each job has its own
+// renderer and context, so models are rendered in parallel.
+// encoders = threads that compress PNGs while the next models render (0 = same as jobs)
+int thumbnail_models(string listFile, int width, int height, int jobs, int encoders, bool software, const ImageParams& params, ImageCache* cache) {
+	vector<string> models;
+	ifstream file(listFile);
+	string line;
+	while (getline(file, line)) {
+		line.erase(line.find_last_not_of(" \t\r\n") + 1);
+		if (line.size()) {
+			models.push_back(line);
+		}
+	}
+
+	if (models.empty()) {
+		cout << "ERROR: No models listed in " << listFile << endl;
+		return 1;
+	}
+
+#ifdef WIN32
+	if (!software) {
+		jobs = 1; // GLFW windows can only be created on the main thread
+	}
+#endif
+	jobs = max(1, min(jobs, (int)models.size()));
+
+	uint64_t startTime = getEpochMillis();
+	std::atomic<int> nextModel(0);
+	std::atomic<int> failures(0);
+	PngEncodeQueue encodeQueue(encoders > 0 ? encoders : jobs);
+
+	auto worker = [&]() {
+		bool legacy = true;
+		bool headless = true;
+		Renderer renderer("", width, height, legacy, headless, software);
+		renderer.set_render_threads(max(1, (int)std::thread::hardware_concurrency() / jobs));
+		renderer.encodeQueue = &encodeQueue;
+
+		for (int i = nextModel++; i < models.size(); i = nextModel++) {
+			string outputFile = replaceString(models[i], ".mdl", ".png");
+
+			string cacheKey;
+			if (cache) {
+				cacheKey = cache->getKey(models[i], width, height, software, params);
+				if (cache->load(cacheKey, outputFile)) {
+					continue;
+				}
+			}
+
+			// called from an encoder thread once the image is written
+			auto onSaved = [&failures, cache, cacheKey, outputFile](bool success) {
+				if (!success) {
+					failures++;
+				}
+				else if (cache) {
+					cache->store(cacheKey, outputFile);
+				}
+			};
+
+			if (!renderer.load_model(models[i]) || !renderer.create_image(outputFile, params, onSaved)) {
+				failures++;
+			}
+		}
+	};
+
+	vector<std::thread> threads;
+	for (int i = 1; i < jobs; i++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for (int i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+	encodeQueue.finish();
+
+	printf("Rendered %d models in %.2fs (%d jobs, %d encoders, peak encode queue %d/%d, %d failed)\n",
+		(int)models.size(), TimeDifference(startTime, getEpochMillis()), jobs, encodeQueue.getThreadCount(),
+		encodeQueue.getPeakDepth(), encodeQueue.getMaxQueued(), failures.load());
+	if (cache) {
+		cache->printStats();
+	}
+
+	return failures ? 1 : 0;
+}
+
 #ifndef EMSCRIPTEN
 
 int main(int argc, char* argv[])
@@ -273,6 +475,15 @@ int main(int argc, char* argv[])
 	int cropHeight = 0;
 	bool force = false;
 	bool noanim = false;
+	bool software = false;
+	int jobs = 1;
+	int encoders = 0;
+	ImageParams imageParams;
+	string cacheDir;
+	string streamFormat;
+	bool apng = false;
+	vector<ImageSize> extraSizes;
+	float streamFps = 30;
 	int maxpixels = 512*512;
 
 	bool expectPaletteFile = false;
@@ -313,6 +524,51 @@ int main(int argc, char* argv[])
 					outputFile = arg;
 				}
 			}
+			if (command == "thumbnails") {
+				if (i == 2) {
+					int xidx = larg.find_first_of("x");
+					cropWidth = atoi(larg.substr(0, xidx).c_str());
+					cropHeight = atoi(larg.substr(xidx+1).c_str());
+				}
+				else if (i == 3) {
+					inputFile = arg;
+				}
+				if (larg.find("--jobs=") == 0) {
+					jobs = atoi(larg.substr(eq + 1).c_str());
+				}
+				if (larg.find("--encoders=") == 0) {
+					encoders = atoi(larg.substr(eq + 1).c_str());
+				}
+			}
+			if (command == "image" || command == "thumbnails") {
+				if (arg == "-software") {
+					software = true;
+				}
+				parse_image_option(larg, imageParams);
+				if (larg.find("--stream=") == 0) {
+					streamFormat = larg.substr(eq + 1);
+				}
+				if (larg.find("--sizes=") == 0) {
+					stringstream sizes(larg.substr(eq + 1));
+					string dims;
+					while (getline(sizes, dims, ',')) {
+						size_t xidx = dims.find_first_of("x");
+						ImageSize size;
+						size.width = atoi(dims.substr(0, xidx).c_str());
+						size.height = xidx != string::npos ? atoi(dims.substr(xidx + 1).c_str()) : size.width;
+						extraSizes.push_back(size);
+					}
+				}
+				if (larg == "--apng") {
+					apng = true;
+				}
+				if (larg.find("--fps=") == 0) {
+					streamFps = atof(larg.substr(eq + 1).c_str());
+				}
+				if (larg.find("--cache=") == 0) {
+					cacheDir = arg.substr(eq + 1); // not lowercased
+				}
+			}
 			if (command == "downscale") {
 				if (i == 4) {
 					maxpixels = atoi(arg.c_str());
@@ -366,6 +622,21 @@ int main(int argc, char* argv[])
 			"  type      : Identify player model type. The return code is unique per mod.\n"
 			"  view      : View the model in 3D.\n"
 			"  image     : Saves a PNG image of the model. Takes <width>x<height> and <output.png> as parameters.\n"
+			"              Add -software to render on the CPU instead of with OpenGL.\n"
+			"  thumbnails: Saves PNG images next to every model in a list file (one path per line).\n"
+			"              Takes <width>x<height> and <list.txt> as parameters. Add --jobs=<N> to render\n"
+			"              N models at once, and -software to render on the CPU. PNGs are compressed in the\n"
+			"              background by --encoders=<N> threads (default: same as --jobs).\n"
+			"              View options for image and thumbnails: --sequence=<N> --frame=<N> --yaw=<degrees>\n"
+			"              --pitch=<degrees> --body=<N> --skin=<N> --topcolor=<0-255> --bottomcolor=<0-255>\n"
+			"              Add --grid=<angles>x<frames> to save a sprite sheet of the model rotating (columns)\n"
+			"              and animating (rows). The image size is per cell.\n"
+			"              Add --stream=<rgba|y4m> to write one loop of the sequence as raw video frames instead\n"
+			"              of a PNG, at --fps=<N> (default 30). Use - as the output file for stdout.\n"
+			"              Add --apng to save one loop of the sequence as an animated PNG, at --fps=<N>.\n"
+			"              Add --sizes=<W>x<H>,<W>x<H>,... to also save smaller copies from the same render,\n"
+			"              named <output>_<W>x<H>.png (--cache is not used).\n"
+			"              Add --cache=<dir> to reuse images of models that haven't changed since the last run.\n"
 			"  layout    : Show data layout for the MDL file.\n"
 			"  downscale : Downscale all textures to the given max pixel count.\n"
 			"  optimize  : deduplicate data.\n\n"
@@ -375,6 +646,11 @@ int main(int argc, char* argv[])
 			"  modelguy crop face.bmp 100x80 hgrunt.mdl\n"
 			"  modelguy rename hev_arm.bmp Remap1_000_255_255.bmp v_shotgun.mdl\n"
 			"  modelguy image player.mdl 800x400 player.png\n"
+			"  modelguy image player.mdl 256x256 player_back.png --yaw=180 --sequence=3 --frame=10\n"
+			"  modelguy image player.mdl 800x400 player.png --sizes=256x256,128x128,64x64\n"
+			"  modelguy image player.mdl 128x128 player_sheet.png --grid=8x4 --sequence=3\n"
+			"  modelguy image player.mdl 256x256 - --stream=y4m --sequence=3 | ffmpeg -i - player.webm\n"
+			"  modelguy thumbnails 800x400 models.txt --jobs=8 --cache=thumbcache\n"
 			"  modelguy porthl player.mdl player_v1sc.mdl\n"
 			"  modelguy porthl bucket.mdl bucket.mdl -noanim\n"
 			;
@@ -519,15 +795,54 @@ int main(int argc, char* argv[])
 		}
 		data_layout_model(inputFile);
 	}
+	else if (command == "thumbnails") {
+		if (cropWidth <= 0 || cropHeight <= 0) {
+			cout << "ERROR: Bad image dimensions: " << cropWidth << "x" << cropHeight << endl;
+			return 1;
+		}
+		ImageCache* cache = cacheDir.size() ? new ImageCache(cacheDir) : NULL;
+		int ret = thumbnail_models(inputFile, cropWidth, cropHeight, jobs, encoders, software, imageParams, cache);
+		delete cache;
+		return ret;
+	}
 	else if (command == "image") {
 		if (inputFile.size() == 0) {
 			cout << "ERROR: No input file specified\n";
 			return 1;
 		}
+		if (streamFormat.size()) {
+			if (streamFormat != "rgba" && streamFormat != "y4m") {
+				cout << "ERROR: Unknown stream format: " << streamFormat << endl;
+				return 1;
+			}
+			if (outputFile.size() == 0 || outputFile == inputFile) {
+				outputFile = "-";
+			}
+			return stream_model(inputFile, outputFile, cropWidth, cropHeight, software, imageParams, streamFormat, streamFps);
+		}
 		if (outputFile.size() == 0 || outputFile == inputFile) {
 			outputFile = replaceString(inputFile, ".mdl", ".png");
 		}
-		return image_model(inputFile, outputFile, cropWidth, cropHeight);
+		if (apng) {
+			return animate_model(inputFile, outputFile, cropWidth, cropHeight, software, imageParams, streamFps);
+		}
+		if (extraSizes.size()) {
+			for (const ImageSize& size : extraSizes) {
+				if (size.width <= 0 || size.height <= 0) {
+					cout << "ERROR: Bad image dimensions: " << size.width << "x" << size.height << endl;
+					return 1;
+				}
+			}
+			if (imageParams.gridAngles * imageParams.gridFrames > 1) {
+				cout << "ERROR: --sizes can't be combined with --grid\n";
+				return 1;
+			}
+			return image_model_sizes(inputFile, outputFile, cropWidth, cropHeight, extraSizes, software, imageParams);
+		}
+		ImageCache* cache = cacheDir.size() ? new ImageCache(cacheDir) : NULL;
+		int ret = image_model(inputFile, outputFile, cropWidth, cropHeight, software, imageParams, cache);
+		delete cache;
+		return ret;
 	}
 	else {
 		cout << "unrecognized command: " << command << endl;
@@ -10,25 +10,29 @@
 #endif
 
 #include <emscripten/emscripten.h>
+#include <emscripten/fetch.h>
 #include <sys/time.h>
 #include <time.h>
 #include <deque>
+#include <cstring>
 
 float angleStep = 1.0f;
 
-volatile bool newModelReady = false;
 volatile bool shouldUnloadCurrentModel = false;
-char newModelPath[1024];
 
 int width = 500;
 int height = 800;
 bool g_paused = false;
+bool g_sleeping = false; // the main loop is stopped until an export changes something
 
 uint64 lastFrameTime;
 std::deque<float> framerates;
 volatile bool program_ready = false;
 
 Renderer* renderer;
+std::vector<MdlFileBuffer> g_memory_files; // files added for the next load_model_from_memory
+
+void retry_model_download();
 
 void em_loop() {
 
@@ -38,16 +42,16 @@ void em_loop() {
 		shouldUnloadCurrentModel = false;
 	}
 
-	if (newModelReady) {
-		printf("Loading newly downloaded model '%s'\n", newModelPath);
-		newModelReady = false;
-
-		if (renderer->load_model(newModelPath)) {
-			EM_ASM( hlms_model_load_complete(true); );
-		}
-		else {
-			EM_ASM( hlms_model_load_complete(false); );
-		}
+	// the previous model keeps rendering until the new one is ready
+	int loadStatus = renderer->update_model_load();
+	if (loadStatus == MODEL_LOAD_DONE) {
+		EM_ASM( hlms_model_load_complete(true); );
+	}
+	else if (loadStatus == MODEL_LOAD_FAILED) {
+		EM_ASM( hlms_model_load_complete(false); );
+	}
+	else if (loadStatus == MODEL_LOAD_MISMATCH) {
+		retry_model_download();
 	}
 
 	// for some reason this doesn't work in the main method
@@ -58,7 +62,12 @@ void em_loop() {
 		);
 	}
 
-	if (g_paused) {
+	if (g_paused || !renderer->needs_redraw()) {
+		// stop the loop if nothing will change until the page calls an export
+		if (loadStatus != MODEL_LOAD_PENDING && (g_paused || renderer->time_until_redraw() < 0)) {
+			g_sleeping = true;
+			emscripten_pause_main_loop();
+		}
 		return;
 	}
 
@@ -69,69 +78,257 @@ void em_loop() {
 	//center_and_scale_model(settings);
 }
 
-bool file_exists(std::string fpath) {
-	if (FILE* file = fopen(fpath.c_str(), "r"))
-	{
-		fclose(file);
-		return true;
+// restart the main loop after it was stopped for a static view
+void wake_loop() {
+	if (g_sleeping) {
+		g_sleeping = false;
+		emscripten_resume_main_loop();
 	}
-	return false;
 }
 
+// files for the model being downloaded. All files are fetched at once.
+struct ModelDownload {
+	int id; // incremented for each model, to ignore files from a model that was replaced
+	int pending;
+	bool failed;
+	std::string mdlPath;
+	std::vector<MdlFileBuffer> files; // downloaded data, passed to the loader without using the filesystem
+
+	// request parameters, for downloading again if the persisted files are out of date
+	std::string folderUrl;
+	std::string modelName;
+	std::string tModel;
+	int seqGroups;
+	std::string version;
+	bool replaced; // files were downloaded again instead of using the IndexedDB copies
+};
+ModelDownload g_download;
+
+struct FileRequest {
+	int downloadId;
+	std::string localFile;
+};
+
+void finish_file_download(FileRequest* req, bool success) {
+	if (req->downloadId != g_download.id) {
+		return; // a different model was requested since this started
+	}
 
-void download_file(std::string url, std::string local_file)
-{
-	if (file_exists(local_file))
-	{
-		printf("Loading %s from cache\n", local_file.c_str());
+	if (!success) {
+		g_download.failed = true;
+	}
+
+	if (--g_download.pending > 0) {
+		return;
+	}
+
+	if (g_download.failed) {
+		for (int i = 0; i < g_download.files.size(); i++) {
+			delete[] g_download.files[i].data;
+		}
+		EM_ASM( hlms_model_load_complete(false); );
 	}
 	else {
-		printf("Downloading file %s -> %s\n", url.c_str(), local_file.c_str());
-		emscripten_wget(url.c_str(), local_file.c_str());
+		printf("Loading newly downloaded model '%s'\n", g_download.mdlPath.c_str());
+		renderer->load_model_async(g_download.mdlPath, g_download.files, g_download.version);
+		wake_loop();
+	}
+
+	g_download.files.clear();
+}
+
+void fetch_complete(emscripten_fetch_t* fetch) {
+	FileRequest* req = (FileRequest*)fetch->userData;
+	bool success = fetch->status == 200;
+
+	if (success && req->downloadId == g_download.id) {
+		// fetch frees its data on close, so this is the only copy made
+		MdlFileBuffer file;
+		file.path = req->localFile;
+		file.len = fetch->numBytes;
+		file.data = new char[file.len];
+		memcpy(file.data, fetch->data, file.len);
+		g_download.files.push_back(file);
+	}
+	else if (!success) {
+		printf("Failed to download %s (HTTP %d)\n", fetch->url, fetch->status);
 	}
+
+	finish_file_download(req, success);
+	delete req;
+	emscripten_fetch_close(fetch);
+}
+
+// Start downloading a file. If a version is given, the file is saved in IndexedDB under a URL
+// containing the version, so that later visits load it without a request. Otherwise the
+// browser HTTP cache handles revalidation. replace = ignore and overwrite the IndexedDB copy.
+void download_file(std::string url, std::string local_file, std::string version, bool replace)
+{
+	FileRequest* req = new FileRequest();
+	req->downloadId = g_download.id;
+	req->localFile = local_file;
+	g_download.pending++;
+
+	emscripten_fetch_attr_t attr;
+	emscripten_fetch_attr_init(&attr);
+	strcpy(attr.requestMethod, "GET");
+	attr.attributes = EMSCRIPTEN_FETCH_LOAD_TO_MEMORY;
+	attr.onsuccess = fetch_complete;
+	attr.onerror = fetch_complete;
+	attr.userData = req;
+
+	if (version.size()) {
+		attr.attributes |= EMSCRIPTEN_FETCH_PERSIST_FILE;
+		url += "?v=" + version;
+	}
+	if (replace) {
+		attr.attributes |= EMSCRIPTEN_FETCH_REPLACE;
+	}
+
+	printf("Downloading file %s -> %s\n", url.c_str(), local_file.c_str());
+	emscripten_fetch(&attr, url.c_str());
+}
+
+// ignore files from the download in progress, if any
+void cancel_model_download() {
+	g_download.id++;
+	g_download.pending = 0;
+	g_download.failed = false;
+	for (int i = 0; i < g_download.files.size(); i++) {
+		delete[] g_download.files[i].data;
+	}
+	g_download.files.clear();
+}
+
+// download every file for the model in g_download
+void start_model_download(bool replace) {
+	cancel_model_download();
+	g_download.replaced = replace;
+
+	// hold the completion check until every request is started
+	g_download.pending++;
+
+	std::string version = g_download.version;
+	download_file(g_download.folderUrl + g_download.mdlPath, g_download.mdlPath, version, replace);
+	if (g_download.tModel.size() > 0) {
+		download_file(g_download.folderUrl + g_download.tModel, g_download.tModel, version, replace);
+	}
+	for (int i = 1; i < g_download.seqGroups; i++) {
+		std::string seq_mdl_path = g_download.modelName;
+		if (i < 10)
+			seq_mdl_path += "0";
+		seq_mdl_path += std::to_string(i) + ".mdl";
+		download_file(g_download.folderUrl + seq_mdl_path, seq_mdl_path, version, replace);
+	}
+
+	FileRequest req;
+	req.downloadId = g_download.id;
+	finish_file_download(&req, true);
+}
+
+// The downloaded model isn't the requested version. IndexedDB may have a file that was saved
+// under this version by mistake, so download everything again without using it.
+void retry_model_download() {
+	if (g_download.replaced) {
+		printf("Downloaded model %s still doesn't match version %s\n", g_download.mdlPath.c_str(),
+			g_download.version.c_str());
+		EM_ASM( hlms_model_load_complete(false); );
+		return;
+	}
+
+	printf("Downloading %s again\n", g_download.mdlPath.c_str());
+	start_model_download(true);
 }
 
 // functions to be called from javascript
 extern "C" {
+	// version = md5 of the model file (as in the model info json), for caching downloads in
+	// IndexedDB and finding the model in the model cache. The loaded model is checked against
+	// it. Can be empty, in which case the model is always downloaded.
+	EMSCRIPTEN_KEEPALIVE void load_new_model_version(const char* model_folder_url, const char* model_name, const char* t_model, int seq_groups, const char* version) {
+		g_download.folderUrl = model_folder_url;
+		g_download.modelName = model_name;
+		g_download.mdlPath = g_download.modelName + ".mdl";
+		g_download.tModel = t_model;
+		g_download.seqGroups = seq_groups;
+		g_download.version = version;
+
+		// without a version there's no way to tell if the cached model is the latest one
+		if (g_download.version.size() && renderer->use_cached_model(g_download.mdlPath, g_download.version)) {
+			cancel_model_download();
+			printf("Loaded %s from the model cache\n", g_download.mdlPath.c_str());
+			EM_ASM( hlms_model_load_complete(true); );
+			return;
+		}
+
+		start_model_download(false);
+	}
+
 	EMSCRIPTEN_KEEPALIVE void load_new_model(const char* model_folder_url, const char* model_name, const char* t_model, int seq_groups) {
-		std::string model_folder_url_str(model_folder_url);
-		std::string model_name_str(model_name);
-		std::string mdl_path = model_name_str + ".mdl";
-		std::string t_mdl_path = std::string(t_model);
+		load_new_model_version(model_folder_url, model_name, t_model, seq_groups, "");
+	}
 
-		std::string mdl_url = model_folder_url_str + mdl_path;
+	// Buffer for a model file that javascript already has. Fill it and then pass it
+	// to add_model_file or load_model_from_memory, which take ownership of it.
+	EMSCRIPTEN_KEEPALIVE char* alloc_model_buffer(int len) {
+		return new char[len];
+	}
 
-		download_file(mdl_url, mdl_path);
-		if (t_mdl_path.size() > 0) {
-			download_file(model_folder_url_str + t_mdl_path, t_mdl_path);
-		}
-		for (int i = 1; i < seq_groups; i++) {
-			std::string seq_mdl_path = model_name_str;
-			if (i < 10)
-				seq_mdl_path += "0";
-			seq_mdl_path += std::to_string(i) + ".mdl";
-			download_file(model_folder_url_str + seq_mdl_path, seq_mdl_path);
-		}
+	// add a texture model (<name>t.mdl) or sequence group (<name>01.mdl) for the next load_model_from_memory
+	EMSCRIPTEN_KEEPALIVE void add_model_file(const char* file_name, char* data, int len) {
+		MdlFileBuffer file;
+		file.path = file_name;
+		file.data = data;
+		file.len = len;
+		g_memory_files.push_back(file);
+	}
+
+	// Show a recently used model without downloading it again. version = model md5 or empty.
+	// Returns 0 if the model isn't cached.
+	EMSCRIPTEN_KEEPALIVE int use_cached_model(const char* file_name, const char* version) {
+		wake_loop();
+		return renderer->use_cached_model(file_name, version) ? 1 : 0;
+	}
 
-		strcpy_safe(newModelPath, mdl_path.c_str(), 1024);
-		newModelReady = true;
+	// memory budget for models that were recently shown, in megabytes
+	EMSCRIPTEN_KEEPALIVE void set_model_cache_size(int megabytes) {
+		renderer->model_cache_bytes = (size_t)megabytes * 1024 * 1024;
+	}
+
+	// load a model from a buffer made by alloc_model_buffer, along with the files from add_model_file
+	EMSCRIPTEN_KEEPALIVE void load_model_from_memory(const char* file_name, char* data, int len) {
+		add_model_file(file_name, data, len);
+		renderer->load_model_async(file_name, g_memory_files);
+		g_memory_files.clear();
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void set_animation(int idx) {
 		renderer->change_animation(idx);
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void set_body(int body) {
 		renderer->renderOpts.body = body;
+		wake_loop();
+	}
+
+	// hues (0-255) for remappable textures. -1 = original colors
+	EMSCRIPTEN_KEEPALIVE void set_colors(int topcolor, int bottomcolor) {
+		renderer->renderOpts.topcolor = topcolor;
+		renderer->renderOpts.bottomcolor = bottomcolor;
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void pause(int paused) {
 		g_paused = paused != 0;
 		renderer->reset_view();
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void set_wireframe(int wireframe) {
 		renderer->renderOpts.wireframe = wireframe != 0;
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void reset_zoom() {
@@ -140,12 +337,14 @@ extern "C" {
 
 	EMSCRIPTEN_KEEPALIVE void unload_model() {
 		shouldUnloadCurrentModel = true;
+		wake_loop();
 	}
 
 	EMSCRIPTEN_KEEPALIVE void update_viewport(int newWidth, int newHeight) {
 		width = newWidth;
 		height = newHeight;
 		renderer->resize_view(width, height);
+		wake_loop();
 		printf("Viewport resized: %dx%d\n", width, height);
 	}
 }
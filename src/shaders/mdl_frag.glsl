@@ -3,18 +3,94 @@ varying vec2 fTex;
 varying vec4 fColor;
 
 uniform vec4 colorMult;
-uniform int additiveEnable;
 uniform sampler2D sTex;
 
+#ifdef PALETTED
+uniform sampler2D sPalette; // 256x1 colors for the indexes in sTex
+uniform vec2 texSize; // width and height of sTex
+#endif
+
+#ifdef REMAP
+uniform vec4 remapRanges; // top color first/last index, bottom color first/last index
+uniform vec2 remapHues; // top and bottom color hues (0-360)
+
+// GoldSrc player color remapping. Keeps the brightness and saturation of the palette color.
+vec3 hueReplace(vec3 color, float hue) {
+	float val = max(max(color.r, color.g), color.b);
+	float mincol = min(min(color.r, color.g), color.b);
+	float delta = val - mincol;
+
+	if (hue <= 120.0) {
+		if (hue < 60.0)
+			return vec3(val, mincol + hue * delta / (120.0 - hue), mincol);
+		return vec3(mincol + (120.0 - hue) * delta / hue, val, mincol);
+	}
+	else if (hue <= 240.0) {
+		if (hue < 180.0)
+			return vec3(mincol, val, mincol + (hue - 120.0) * delta / (240.0 - hue));
+		return vec3(mincol, mincol + (240.0 - hue) * delta / (hue - 120.0), val);
+	}
+	
+	if (hue < 300.0)
+		return vec3(mincol + (hue - 240.0) * delta / (360.0 - hue), mincol, val);
+	return vec3(val, mincol, mincol + (360.0 - hue) * delta / (hue - 240.0));
+}
+#endif
+
+#ifdef PALETTED
+// color of the nearest texel to uv
+vec4 paletteTexel(vec2 uv) {
+	float idx = texture2D(sTex, uv).r * 255.0;
+	vec4 texel = texture2D(sPalette, vec2((idx + 0.5) / 256.0, 0.5));
+
+#ifdef REMAP
+	idx = floor(idx + 0.5);
+	if (idx >= remapRanges.x && idx <= remapRanges.y)
+		texel.rgb = hueReplace(texel.rgb, remapHues.x);
+	else if (idx >= remapRanges.z && idx <= remapRanges.w)
+		texel.rgb = hueReplace(texel.rgb, remapHues.y);
+#endif
+
+	return texel;
+}
+#endif
+
 void main()
 {
+#ifdef PALETTED
+	// Indexes can't be interpolated, so sTex is always sampled with GL_NEAREST. Filter the
+	// palette colors here instead, like GL_LINEAR minification of a color texture.
+	vec2 texCoord = fTex * texSize;
+	vec2 dx = dFdx(texCoord);
+	vec2 dy = dFdy(texCoord);
+	vec4 texel;
+
+	if (max(dot(dx, dx), dot(dy, dy)) > 1.0) {
+		vec2 pos = texCoord - 0.5;
+		vec2 f = fract(pos);
+		vec2 uv = (floor(pos) + 0.5) / texSize;
+		vec2 texelSize = 1.0 / texSize;
+
+		vec4 top = mix(paletteTexel(uv), paletteTexel(uv + vec2(texelSize.x, 0.0)), f.x);
+		vec4 bottom = mix(paletteTexel(uv + vec2(0.0, texelSize.y)), paletteTexel(uv + texelSize), f.x);
+		texel = mix(top, bottom, f.y);
+	}
+	else {
+		texel = paletteTexel(fTex);
+	}
+#else
 	vec4 texel = texture2D(sTex, fTex);
+#endif
 	
+#ifdef MASKED
 	if (texel.a < 0.5)
-		discard; // GL_ALPHA_TEST alternative for WebGL (TODO: expensive. Don't use this for every mdl draw call)
-	
-	if (additiveEnable != 0 && texel.xyz == vec3(0,0,0))
+		discard; // GL_ALPHA_TEST alternative for WebGL
+#endif
+
+#ifdef ADDITIVE
+	if (texel.xyz == vec3(0,0,0))
 		discard; // additive black textures mess up the transparent background
+#endif
 	
 	gl_FragColor = texel * fColor * colorMult;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #define STUDIO_NF_ADDITIVE 0x20
 
 uniform mat4 modelViewProjection;
+uniform vec2 uvScale; // converts vTex to texture coordinates (see MdlDrawItem::uvScale)
 
 // Lighting uniforms
 uniform mat4 modelView;
@@ -11,10 +12,11 @@ uniform mat3 lights[4];
 uniform int elights;
 uniform vec3 ambient;
 
-// render flags
-uniform int chromeEnable;
-uniform int additiveEnable;
-uniform int flatshadeEnable;
+// render flags are compiled as shader variants (see Renderer::compile_shaders)
+// ADDITIVE   - unlit, black texels are discarded
+// FLATSHADE  - ambient lighting only
+// FULLBRIGHT - unlit
+// MASKED     - transparent texels are discarded
 
 // chrome uniforms
 uniform vec3 viewerOrigin;
@@ -37,22 +39,15 @@ void main()
 {
 	gl_Position = modelViewProjection * vec4(vPosition, 1);
 
-	if (chromeEnable != 0) {
-		fTex.x = vBone; // just keeping the var active to stop error spam (chrome uniform is never enabled)
-	} else {
-		fTex = vTex;
-	}
+	fTex = vTex * uvScale; // chrome coordinates are calculated on the CPU in legacy mode
 
-	// TODO: compile multiple shaders and control this if #ifdef
-	if (additiveEnable != 0) {
-		fColor = vec4(1, 1, 1, 1);
-	} else if (flatshadeEnable == 1) {
-		fColor = vec4(ambient*0.725, 1); // trying to match HLMV
-	} else if (flatshadeEnable == 2) {
-		fColor = vec4(1, 1, 1, 1);
-	} else {
-		fColor = lighting(vNormal);
-	}
+#if defined(ADDITIVE) || defined(FULLBRIGHT)
+	fColor = vec4(1, 1, 1, 1);
+#elif defined(FLATSHADE)
+	fColor = vec4(ambient*0.725, 1); // trying to match HLMV
+#else
+	fColor = lighting(vNormal);
+#endif
 }
 
 vec4 lighting(vec3 tNormal)
@@ -3,6 +3,7 @@
 #define STUDIO_NF_ADDITIVE 0x20
 
 uniform mat4 modelViewProjection;
+uniform vec2 uvScale; // converts vTex to texture coordinates (see MdlDrawItem::uvScale)
 
 // Lighting uniforms
 uniform mat4 modelView;
@@ -16,10 +17,12 @@ uniform vec3 ambient;
 // Can't use UBO without upgrading to GL 3.1. Can't have 128 mat4 uniforms for all GPUs.
 uniform sampler2D boneMatrixTexture;
 
-// render flags
-uniform int chromeEnable;
-uniform int additiveEnable;
-uniform int flatshadeEnable;
+// render flags are compiled as shader variants (see Renderer::compile_shaders)
+// CHROME     - generate texture coordinates from the view direction
+// ADDITIVE   - unlit, black texels are discarded
+// FLATSHADE  - ambient lighting only
+// FULLBRIGHT - unlit
+// MASKED     - transparent texels are discarded
 
 // chrome uniforms
 uniform vec3 viewerOrigin;
@@ -54,22 +57,19 @@ void main()
 
 	gl_Position = modelViewProjection * vec4(pos, 1);
 
-	if (chromeEnable != 0) {
-		fTex = chrome(tNormal, bone);
-	} else {
-		fTex = vTex;
-	}
-
-	// TODO: compile multiple shaders and control this if #ifdef
-	if (additiveEnable != 0) {
-		fColor = vec4(1, 1, 1, 1);
-	} else if (flatshadeEnable == 1) {
-		fColor = vec4(ambient*0.725, 1);
-	} else if (flatshadeEnable == 2) {
-		fColor = vec4(1, 1, 1, 1);
-	} else {
-		fColor = lighting(tNormal);
-	}
+#ifdef CHROME
+	fTex = chrome(tNormal, bone);
+#else
+	fTex = vTex * uvScale;
+#endif
+
+#if defined(ADDITIVE) || defined(FULLBRIGHT)
+	fColor = vec4(1, 1, 1, 1);
+#elif defined(FLATSHADE)
+	fColor = vec4(ambient*0.725, 1);
+#else
+	fColor = lighting(tNormal);
+#endif
 }
 
 vec3 rotateVector(vec3 v, inout mat4 mat)
@@ -0,0 +1,64 @@
+#include "arena.h"
+#include <string.h>
+
+Arena::Arena(size_t blockSize) {
+	this->blockSize = blockSize;
+}
+
+Arena::~Arena() {
+	clear();
+}
+
+void* Arena::allocBytes(size_t bytes, size_t alignment) {
+	if (blocks.size()) {
+		Block& block = blocks.back();
+		size_t offset = (block.used + alignment - 1) & ~(alignment - 1);
+
+		if (offset + bytes <= block.size) {
+			block.used = offset + bytes;
+			return block.data + offset;
+		}
+	}
+
+	addBlock(bytes > blockSize ? bytes : blockSize);
+
+	// new blocks are aligned for any type
+	Block& block = blocks.back();
+	block.used = bytes;
+	return block.data;
+}
+
+void Arena::reserve(size_t bytes) {
+	if (blocks.size()) {
+		Block& block = blocks.back();
+		if (block.size - block.used >= bytes + alignof(max_align_t)) {
+			return;
+		}
+	}
+
+	addBlock(bytes + alignof(max_align_t));
+}
+
+void Arena::addBlock(size_t size) {
+	Block block;
+	block.size = size;
+	block.data = new char[block.size];
+	block.used = 0;
+	memset(block.data, 0, block.size);
+	blocks.push_back(block);
+}
+
+size_t Arena::size() {
+	size_t total = 0;
+	for (int i = 0; i < blocks.size(); i++) {
+		total += blocks[i].size;
+	}
+	return total;
+}
+
+void Arena::clear() {
+	for (int i = 0; i < blocks.size(); i++) {
+		delete[] blocks[i].data;
+	}
+	blocks.clear();
+}
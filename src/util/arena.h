@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+
+// Bump allocator for data that lives as long as its owner. Allocations are zeroed, can't be
+// freed individually, and are all released at once when the arena is destroyed or cleared.
+// Destructors are never called, so only allocate types that don't need one.
+class Arena
+{
+public:
+	// blockSize = minimum size of blocks added when an allocation doesn't fit
+	Arena(size_t blockSize = 16 * 1024);
+	~Arena();
+
+	// allocate zeroed memory for count objects
+	template<typename T>
+	T* alloc(size_t count = 1) {
+		return (T*)allocBytes(sizeof(T) * count, alignof(T));
+	}
+
+	void* allocBytes(size_t bytes, size_t alignment);
+
+	// make sure the next allocations totaling this many bytes will be contiguous. If a block
+	// is added for them, it's exactly that size (plus alignment), not the minimum block size.
+	void reserve(size_t bytes);
+
+	// bytes allocated from the system
+	size_t size();
+
+	// free all allocations
+	void clear();
+
+private:
+	struct Block {
+		char* data;
+		size_t size;
+		size_t used;
+	};
+
+	std::vector<Block> blocks;
+	size_t blockSize;
+
+	void addBlock(size_t size);
+};
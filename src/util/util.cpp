@@ -41,6 +41,25 @@ char * loadFile( const string& fileName, int& length)
 	return buffer;
 }
 
+bool writeFile(const string& fileName, const char* data, int length)
+{
+	ofstream fout(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!fout.is_open())
+		return false;
+	fout.write(data, length);
+	fout.close();
+	return !fout.fail();
+}
+
+bool createDir(const string& path) {
+#ifdef _WIN32
+	return CreateDirectoryA(path.c_str(), NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+	struct stat result;
+	return mkdir(path.c_str(), 0755) == 0 || (stat(path.c_str(), &result) == 0 && S_ISDIR(result.st_mode));
+#endif
+}
+
 bool invalidChar(char c) {
 	return !(c >= 32 && c < 127);
 }
@@ -166,6 +185,15 @@ string getFileName(const string& path) {
 	return ret;
 }
 
+string getExternalModelPath(const string& mdlPath, const string& suffix) {
+	size_t lastDot = mdlPath.find_last_of(".");
+	if (lastDot == string::npos) {
+		return mdlPath + suffix;
+	}
+
+	return mdlPath.substr(0, lastDot) + suffix + mdlPath.substr(lastDot);
+}
+
 void winPath(string& path)
 {
 	for (int i = 0, size = path.size(); i < size; i++)
@@ -10,6 +10,10 @@ bool fileExists(const string& fileName);
 
 char * loadFile( const string& fileName, int& length);
 
+bool writeFile(const string& fileName, const char* data, int length);
+
+bool createDir(const string& path); // true if the directory exists afterwards
+
 string sanitize_string(string input);
 
 std::string toLowerCase(std::string str);
@@ -32,4 +36,7 @@ uint64_t getFileModifiedTime(const std::string& path);
 
 string getFileName(const string& path);
 
+// path of a file that's loaded with a model (suffix "t" = textures, "01" = first sequence group)
+string getExternalModelPath(const string& mdlPath, const string& suffix);
+
 vector<string> getDirFiles(string path, string extension, string startswith, bool onlyOne);